@@ -0,0 +1,192 @@
+#include "archive.h"
+#include "dataset.hpp"
+#include "grader.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const char* QGArchive::EXTENSION = ".qgpk";
+
+static const char ARCHIVE_MAGIC[4] = { 'Q', 'G', 'P', 'K' };
+static const uint32_t ARCHIVE_VERSION = 1;
+
+typedef struct ArchiveHeader
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t count;
+  uint64_t index_offset;
+  uint64_t reserved;
+} ArchiveHeader;
+
+typedef struct ArchiveEntry
+{
+  uint64_t u_offset, u_size;
+  uint64_t d_offset, d_size;
+  uint32_t name_offset, name_length;
+} ArchiveEntry;
+
+QGArchive::~QGArchive()
+{
+  close();
+}
+
+void QGArchive::close()
+{
+  if (mapped)
+    munmap(mapped, mapped_bytes);
+  mapped = nullptr;
+  entries.clear();
+}
+
+int QGArchive::open(const std::string& path)
+{
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ArchiveHeader))
+  {
+    fprintf(stderr, "(!)----Error: cannot open archive %s.\n", path.c_str());
+    if (fd >= 0)
+      ::close(fd);
+    return 0;
+  }
+  mapped_bytes = st.st_size;
+  modified = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  mapped = mmap(nullptr, mapped_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED)
+  {
+    mapped = nullptr;
+    fprintf(stderr, "(!)----Error: cannot map archive %s.\n", path.c_str());
+    return 0;
+  }
+  // blobs are read in name order, the kernel can read ahead aggressively
+  madvise(mapped, mapped_bytes, MADV_SEQUENTIAL);
+
+  const unsigned char* base = (const unsigned char*)mapped;
+  const ArchiveHeader* header = (const ArchiveHeader*)base;
+  uint64_t index_bytes = (uint64_t)header->count * sizeof(ArchiveEntry);
+  if (memcmp(header->magic, ARCHIVE_MAGIC, 4) || header->version != ARCHIVE_VERSION
+    || header->index_offset > mapped_bytes || index_bytes > mapped_bytes - header->index_offset)
+  {
+    fprintf(stderr, "(!)----Error: %s is not a packed lot.\n", path.c_str());
+    close();
+    return 0;
+  }
+  flags = header->flags;
+
+  const ArchiveEntry* index = (const ArchiveEntry*)(base + header->index_offset);
+  const char* names = (const char*)(index + header->count);
+  size_t names_bytes = mapped_bytes - header->index_offset - index_bytes;
+  entries.reserve(header->count);
+  for (uint32_t i = 0; i < header->count; i++)
+  {
+    const ArchiveEntry& entry = index[i];
+    // written as at the header, offset + size of a crafted entry may wrap around
+    if (entry.u_offset > mapped_bytes || entry.u_size > mapped_bytes - entry.u_offset
+      || entry.d_offset > mapped_bytes || entry.d_size > mapped_bytes - entry.d_offset
+      || entry.name_offset > names_bytes || entry.name_length > names_bytes - entry.name_offset)
+    {
+      fprintf(stderr, "(!)----Error: %s has a broken index.\n", path.c_str());
+      close();
+      return 0;
+    }
+    entries.push_back({ std::string(names + entry.name_offset, entry.name_length),
+      base + entry.u_offset, entry.u_size, base + entry.d_offset, entry.d_size });
+  }
+  return 1;
+}
+
+void QGArchive::prefetch(int index) const
+{
+  if (index < 0 || index >= (int)entries.size())
+    return;
+  const Pair& pair = entries[index];
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = (uintptr_t)std::min(pair.u, pair.d) & ~(uintptr_t)(page - 1);
+  uintptr_t end = (uintptr_t)std::max(pair.u + pair.u_size, pair.d + pair.d_size);
+  madvise((void*)begin, end - begin, MADV_WILLNEED);
+}
+
+int QGArchive::pack(const std::string& lot, const std::string& path, bool aligned, int quality)
+{
+  std::vector<std::string> names = listpairs(lot);
+  std::string temporary = path + ".tmp";
+  FILE* file = fopen(temporary.c_str(), "wb");
+  if (!file)
+  {
+    fprintf(stderr, "(!)----Error: cannot create %s.\n", temporary.c_str());
+    return 0;
+  }
+
+  ArchiveHeader header = {};
+  memcpy(header.magic, ARCHIVE_MAGIC, 4);
+  header.version = ARCHIVE_VERSION;
+  header.flags = aligned ? 1 : 0;
+  header.count = names.size();
+  fwrite(&header, sizeof(header), 1, file);
+
+  std::vector<ArchiveEntry> index;
+  std::string name_table;
+  std::vector<unsigned char> bytesU, bytesD;
+  uint64_t offset = sizeof(header);
+  for (const auto& name : names)
+  {
+    if (!readfile(lot + "/U/" + name, bytesU) || !readfile(lot + "/D/" + name, bytesD))
+    {
+      fprintf(stderr, "(!)----Error: cannot read %s/%s.\n", lot.c_str(), name.c_str());
+      fclose(file);
+      return 0;
+    }
+    if (aligned)
+    {
+      cv::Mat imgU = cv::imdecode(bytesU, cv::IMREAD_COLOR);
+      cv::Mat imgD = cv::imdecode(bytesD, cv::IMREAD_COLOR);
+      if (imgU.empty() || imgD.empty())
+      {
+        fprintf(stderr, "(!)----Error: cannot decode %s/%s.\n", lot.c_str(), name.c_str());
+        fclose(file);
+        return 0;
+      }
+      QGGrader::align(imgU, imgD);
+      cv::imencode(".jpg", imgU, bytesU, { cv::IMWRITE_JPEG_QUALITY, quality });
+      cv::imencode(".jpg", imgD, bytesD, { cv::IMWRITE_JPEG_QUALITY, quality });
+    }
+
+    ArchiveEntry entry = {};
+    entry.u_offset = offset;
+    entry.u_size = bytesU.size();
+    entry.d_offset = offset + bytesU.size();
+    entry.d_size = bytesD.size();
+    entry.name_offset = name_table.size();
+    entry.name_length = name.size();
+    name_table += name;
+    index.push_back(entry);
+    fwrite(bytesU.data(), 1, bytesU.size(), file);
+    fwrite(bytesD.data(), 1, bytesD.size(), file);
+    offset += bytesU.size() + bytesD.size();
+  }
+
+  header.index_offset = offset;
+  fwrite(index.data(), sizeof(ArchiveEntry), index.size(), file);
+  fwrite(name_table.data(), 1, name_table.size(), file);
+  fseek(file, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, file);
+  bool written = !ferror(file);
+  written = fclose(file) == 0 && written;
+  // renamed once complete, an interrupted conversion never leaves a truncated lot behind
+  if (!written || rename(temporary.c_str(), path.c_str()) != 0)
+  {
+    fprintf(stderr, "(!)----Error: cannot write %s.\n", path.c_str());
+    unlink(temporary.c_str());
+    return 0;
+  }
+  printf("(i)----packed %d pairs of %s into %s, %.1f MB\n", (int)names.size(), lot.c_str(), path.c_str(), (offset + index.size() * sizeof(ArchiveEntry) + name_table.size()) / 1048576.0);
+  return 1;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Packed lot: the U and D files of every pair of a lot in one file, read through one mapping
+// instead of an open, stat and read per image.
+//   header: "QGPK", u32 version, u32 flags (1 aligned), u32 pairs, u64 index offset, u64 reserved
+//   blobs:  U then D bytes of each pair, in name order
+//   index:  per pair u64 U offset, U size, D offset, D size, u32 name offset, name length,
+//           followed by the names
+// aligned lots hold the views after align(), re-encoded, and skip alignment when read.
+class QGArchive
+{
+public:
+  static const char* EXTENSION;  /* ".qgpk" */
+
+  typedef struct Pair
+  {
+    std::string name;
+    const unsigned char* u;
+    size_t u_size;
+    const unsigned char* d;
+    size_t d_size;
+  } Pair;
+
+public:
+  ~QGArchive();
+  int open(const std::string& path);
+  void close();
+
+  bool aligned() const { return flags & 1; }
+  long long mtime() const { return modified; }  /* nanoseconds */
+  const std::vector<Pair>& pairs() const { return entries; }
+  // asks the kernel to read a pair ahead of its use.
+  void prefetch(int index) const;
+
+  // packs the pairs of a lot directory, quality is the JPEG quality of re-encoded aligned views.
+  static int pack(const std::string& lot, const std::string& path, bool aligned, int quality = 95);
+
+private:
+  void* mapped = nullptr;
+  size_t mapped_bytes = 0;
+  uint32_t flags = 0;
+  long long modified = 0;
+  std::vector<Pair> entries;
+};
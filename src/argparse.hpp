@@ -576,6 +576,12 @@ public:
     variables_.clear();
   }
   bool exists(const std::string& name) const { return index_.count(delimit(name)) > 0; }
+  // canonical name of an option as given on the command line, e.g. "-i" or "--input", empty when unknown
+  std::string canonical(const std::string& option) const
+  {
+    IndexMap::const_iterator found = index_.find(option);
+    return found == index_.end() ? std::string() : arguments_[found->second].canonicalName();
+  }
   size_t count(const std::string& name)
   {
     // check if the name is an argument
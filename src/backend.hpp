@@ -0,0 +1,96 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "Interpreter.hpp"
+#include "MNNForwardType.h"
+
+#include <string>
+#include <cstdio>
+
+// names used by the command line and the config file for the MNN backend options.
+
+inline const char* forward_name(MNNForwardType type)
+{
+  switch (type)
+  {
+  case MNN_FORWARD_CPU: return "cpu";
+  case MNN_FORWARD_AUTO: return "auto";
+  case MNN_FORWARD_METAL: return "metal";
+  case MNN_FORWARD_CUDA: return "cuda";
+  case MNN_FORWARD_OPENCL: return "opencl";
+  case MNN_FORWARD_OPENGL: return "opengl";
+  case MNN_FORWARD_VULKAN: return "vulkan";
+  case MNN_FORWARD_NN: return "nn";
+  default: return "unknown";
+  }
+}
+
+inline const char* precision_name(MNN::BackendConfig::PrecisionMode mode)
+{
+  static const char* names[] = { "normal", "high", "low" };
+  return mode >= 0 && mode < 3 ? names[mode] : "unknown";
+}
+
+inline const char* power_name(MNN::BackendConfig::PowerMode mode)
+{
+  static const char* names[] = { "normal", "high", "low" };
+  return mode >= 0 && mode < 3 ? names[mode] : "unknown";
+}
+
+inline const char* memory_name(MNN::BackendConfig::MemoryMode mode)
+{
+  static const char* names[] = { "normal", "high", "low" };
+  return mode >= 0 && mode < 3 ? names[mode] : "unknown";
+}
+
+inline bool parse_forward(const std::string& name, MNNForwardType& type)
+{
+  for (MNNForwardType t : { MNN_FORWARD_CPU, MNN_FORWARD_AUTO, MNN_FORWARD_METAL, MNN_FORWARD_CUDA,
+    MNN_FORWARD_OPENCL, MNN_FORWARD_OPENGL, MNN_FORWARD_VULKAN, MNN_FORWARD_NN })
+  {
+    if (name == forward_name(t))
+    {
+      type = t;
+      return true;
+    }
+  }
+  return false;
+}
+
+// normal, high and low map to the same values for precision, power and memory modes
+template <typename Mode>
+inline bool parse_mode(const std::string& name, Mode& mode)
+{
+  static const char* names[] = { "normal", "high", "low" };
+  for (int i = 0; i < 3; i++)
+  {
+    if (name == names[i])
+    {
+      mode = (Mode)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// echoes the backend options of a session, and warns when MNN fell back from the requested backend.
+inline void check_backend(const std::string& model, MNN::Interpreter* interpreter, const MNN::Session* session, const MNN::ScheduleConfig& config)
+{
+  int backends[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+  interpreter->getSessionInfo(session, MNN::Interpreter::BACKENDS, backends);
+
+  MNNForwardType used = backends[0] >= 0 ? (MNNForwardType)backends[0] : config.type;
+  bool found = config.type == MNN_FORWARD_AUTO;
+  for (int backend : backends)
+    found |= backend == config.type;
+
+  const MNN::BackendConfig* backend = config.backendConfig;
+  printf("(i)----%s: forward %s, precision %s, power %s, memory %s, threads %d\n", model.c_str(),
+    forward_name(found ? config.type : used), precision_name(backend->precision), power_name(backend->power),
+    memory_name(backend->memory), config.numThread);
+  if (!found)
+    fprintf(stderr, "(!)----Warning: %s backend is not available for %s, running on %s.\n",
+      forward_name(config.type), model.c_str(), forward_name(used));
+}
+
+#endif //BACKEND_H
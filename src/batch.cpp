@@ -0,0 +1,442 @@
+#include "batch.h"
+#include "dataset.hpp"
+#include "timer.hpp"
+#include "loader.h"
+
+#include <thread>
+#include <chrono>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+QGBatch::QGBatch(const std::vector<std::string>& detect_labels, const std::vector<std::string>& classify_labels,
+  QGCache* cache, QGResults* results, QGTensorCache* tensors, QGEvaluator* evaluator)
+  : detect_labels(detect_labels), classify_labels(classify_labels), cache(cache), results(results), tensors(tensors), evaluator(evaluator)
+{
+}
+
+int QGBatch::init(const Params& params)
+{
+  this->params = params;
+  this->params.workers = std::max(1, params.workers);
+  // the models are loaded once, workers lease sessions for inference only and decode without them
+  int sessions = params.sessions > 0 ? std::min(params.sessions, this->params.workers) : this->params.workers;
+  auto load_detectors = [params, sessions]() -> std::shared_ptr<QGDetectorPool>
+  {
+    std::shared_ptr<QGDetectorPool> pool(new QGDetectorPool());
+    return pool->init(params.detector_path, params.dparams, sessions) ? pool : nullptr;
+  };
+  auto load_classifiers = [params, sessions]() -> std::shared_ptr<QGClassifierPool>
+  {
+    std::shared_ptr<QGClassifierPool> pool(new QGClassifierPool());
+    return pool->init(params.classifier_path, params.cparams, sessions) ? pool : nullptr;
+  };
+  if (!detectors.init(params.detector_path, load_detectors) || !classifiers.init(params.classifier_path, load_classifiers))
+  {
+    fprintf(stderr, "(!)----Error: failed to load %s or %s.\n", params.detector_path.c_str(), params.classifier_path.c_str());
+    return 0;
+  }
+  detectors.watch(params.model_poll_ms);
+  classifiers.watch(params.model_poll_ms);
+
+  workers.clear();
+  for (int i = 0; i < this->params.workers; i++)
+  {
+    std::unique_ptr<Worker> worker(new Worker());
+    worker->grader.reset(new QGGrader(detectors.get()->at(0), classifiers.get()->at(0), params.gparams));
+    workers.push_back(std::move(worker));
+  }
+  return 1;
+}
+
+QGBatch::Leases QGBatch::lease(Worker& worker)
+{
+  // always in this order, a worker holds at most one of each
+  Leases leases;
+  leases.detectors = detectors.get();
+  leases.classifiers = classifiers.get();
+  leases.detector = leases.detectors->acquire();
+  leases.classifier = leases.classifiers->acquire();
+  worker.grader->bind(*leases.detector, *leases.classifier);
+  return leases;
+}
+
+int QGBatch::list()
+{
+  // every lot lists its own pairs, dealt out lot by lot so that a worker mostly stays in one lot
+  lots.clear();
+  std::vector<std::string> sources = getlistdir(params.input, S_IFDIR);
+  for (const auto& file : getlistdir(params.input, S_IFREG))
+  {
+    size_t length = strlen(QGArchive::EXTENSION);
+    if (file.size() > length && file.compare(file.size() - length, length, QGArchive::EXTENSION) == 0)
+      sources.push_back(file);
+  }
+  std::sort(sources.begin(), sources.end());
+  for (const auto& source : sources)
+  {
+    std::unique_ptr<Lot> lot(new Lot());
+    std::vector<std::string> names;
+    struct stat st;
+    if (stat((params.input + "/" + source).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+    {
+      lot->name = source.substr(0, source.size() - strlen(QGArchive::EXTENSION));
+      lot->archive.reset(new QGArchive());
+      if (!lot->archive->open(params.input + "/" + source))
+        return 0;
+      for (const auto& pair : lot->archive->pairs())
+        names.push_back(pair.name);
+    }
+    else
+    {
+      lot->name = source;
+      names = listpairs(params.input + "/" + source);
+    }
+
+    std::string dir = lot->name;
+    mkdir((params.outpath + "/" + dir).c_str(), 0755);
+    if (params.incremental)
+    {
+      mkdir((params.manifest_dir + "/" + dir).c_str(), 0755);
+      if (!lot->manifest.open(params.manifest_dir + "/" + dir + "/.manifest"))
+        return 0;
+    }
+
+    Worker& worker = *workers[lots.size() % workers.size()];
+    for (int index = 0; index < (int)names.size(); index++)
+    {
+      const std::string& name = names[index];
+      if (params.shard_count > 1 && QGResults::shard(dir, name, params.shard_count) != params.shard_index)
+        continue;
+      int label = 0;
+      if (evaluator && !evaluator->truth(dir, name, label))
+      {
+        counts.unlabelled++;
+        continue;
+      }
+
+      Item item = { (int)lots.size(), index, name, QGManifest::Entry() };
+      if (params.incremental)
+      {
+        if (lot->archive)
+        {
+          const QGArchive::Pair& pair = lot->archive->pairs()[index];
+          item.entry.mtimeU = item.entry.mtimeD = lot->archive->mtime();
+          item.entry.sizeU = pair.u_size;
+          item.entry.sizeD = pair.d_size;
+        }
+        else if (!QGManifest::stat_pair(params.input + "/" + dir, name, item.entry))
+          continue;
+        if (lot->manifest.done(name, item.entry))
+        {
+          counts.unchanged++;
+          continue;
+        }
+      }
+      worker.queue.push_back(item);
+      lot->remaining++;
+      counts.listed++;
+    }
+    // manifests stay closed until a pair of their lot is finished, large archives have many lots
+    lot->manifest.close();
+    lots.push_back(std::move(lot));
+  }
+  return 1;
+}
+
+bool QGBatch::take(int index, Item& item)
+{
+  {
+    Worker& worker = *workers[index];
+    std::lock_guard<std::mutex> guard(worker.lock);
+    if (!worker.queue.empty())
+    {
+      item = std::move(worker.queue.front());
+      worker.queue.pop_front();
+      return true;
+    }
+  }
+
+  // steal from the back, away from the pairs the victim is about to take
+  for (size_t i = 1; i < workers.size(); i++)
+  {
+    Worker& victim = *workers[(index + i) % workers.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.queue.empty())
+    {
+      item = std::move(victim.queue.back());
+      victim.queue.pop_back();
+      std::lock_guard<std::mutex> counts_guard(counts_lock);
+      counts.stolen++;
+      return true;
+    }
+  }
+  return false;
+}
+
+int QGBatch::run()
+{
+  // every pass reports its own figures
+  counts = Stats();
+  for (auto& worker : workers)
+  {
+    worker->grader->reset();
+    worker->processed = worker->decoded = worker->fed = 0;
+    worker->decode_ms = worker->decoded_bytes = 0;
+    worker->tiles = QGDetector::TileStats();
+  }
+  if (!list())
+    return -1;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  auto work = [this](int index)
+  {
+    Item item;
+    while (take(index, item))
+      grade(*workers[index], item);
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < workers.size(); i++)
+    threads.emplace_back(work, (int)i);
+  work(0);
+  for (auto& thread : threads)
+    thread.join();
+  counts.elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+  // the worker graders may still be bound to a model replaced by a reload, the figures of all of
+  // them are reported on the current one
+  std::shared_ptr<QGDetectorPool> detector_pool = detectors.get();
+  std::shared_ptr<QGClassifierPool> classifier_pool = classifiers.get();
+  QGGrader grader(detector_pool->at(0), classifier_pool->at(0), params.gparams);
+  for (const auto& worker : workers)
+    grader.add(worker->grader->stats());
+  grader.report();
+  QGDetector::TileStats tiles;
+  for (const auto& worker : workers)
+    QGDetector::add_tiles(tiles, worker->tiles);
+  QGDetector::report_tiles(tiles);
+  if (cache)
+    cache->report();
+  detector_pool->report("detector");
+  classifier_pool->report("classifier");
+  if (params.model_poll_ms > 0)
+  {
+    detectors.report("detector");
+    classifiers.report("classifier");
+  }
+  if (tensors)
+  {
+    int fed = 0;
+    for (const auto& worker : workers)
+      fed += worker->fed;
+    tensors->report();
+    printf("    >>> tensor cache: %d pairs graded from cached inputs without decoding\n", fed);
+  }
+  if (params.incremental)
+    printf("    >>> manifest: %d pairs processed, %d skipped as unchanged\n", counts.processed, counts.unchanged);
+  printf("    >>> images: %d pairs in %d lots, %d graded by %d workers (%d stolen), %d failed, %f ms, %.1f pairs/s\n",
+    counts.listed, (int)lots.size(), counts.processed, (int)workers.size(), counts.stolen, counts.failed, counts.elapsed_ms,
+    counts.elapsed_ms > 0 ? 1000.0 * counts.processed / counts.elapsed_ms : 0.0);
+  for (size_t i = 0; i < workers.size() && workers.size() > 1; i++)
+    printf("    >>> worker %d: %d pairs\n", (int)i, workers[i]->processed);
+
+  int decoded = 0;
+  double decode_ms = 0, decoded_bytes = 0;
+  for (const auto& worker : workers)
+  {
+    decoded += worker->decoded;
+    decode_ms += worker->decode_ms;
+    decoded_bytes += worker->decoded_bytes;
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("    >>> decode%s%s: %d pairs, read and decode mean: %f ms, decoded per pair: %.2f MB, peak rss: %.1f MB\n",
+    params.reduced_decode ? " reduced" : "", params.cropped_decode ? " cropped" : "", decoded, decoded ? decode_ms / decoded : 0.0,
+    decoded ? decoded_bytes / decoded / (1 << 20) : 0.0, usage.ru_maxrss / 1024.0);
+  return 0;
+}
+
+void QGBatch::grade(Worker& worker, const Item& item)
+{
+  static const cv::Scalar crDetect(0, 0, 255);
+  Lot& lot = *lots[item.lot];
+  std::string source = params.input + "/" + lot.name;
+  std::string outfile = params.outpath + "/" + lot.name + "/" + item.name;
+  GradeInfo& info = worker.info;
+
+  Timer::GetInstance().tic();
+  auto start = std::chrono::high_resolution_clock::now();
+  auto fail = [&](const char* what)
+  {
+    fprintf(stderr, "(!)----Error: cannot %s %s/%s.\n", what, lot.name.c_str(), item.name.c_str());
+    Timer::GetInstance().toc();
+    std::lock_guard<std::mutex> guard(counts_lock);
+    counts.failed++;
+  };
+
+  std::vector<unsigned char> bytesU, bytesD;
+  uint64_t key = 0;
+  bool hit = false;
+  if (lot.archive)
+  {
+    const QGArchive::Pair& pair = lot.archive->pairs()[item.index];
+    bytesU.assign(pair.u, pair.u + pair.u_size);
+    bytesD.assign(pair.d, pair.d + pair.d_size);
+    lot.archive->prefetch(item.index + 1);
+  }
+  else if (cache || tensors || params.reduced_decode || params.cropped_decode)
+  {
+    if (!readfile(source + "/U/" + item.name, bytesU) || !readfile(source + "/D/" + item.name, bytesD))
+      return fail("read");
+  }
+  if (cache)
+  {
+    key = cache->key(bytesU, bytesD);
+    hit = cache->lookup(key, info);
+  }
+
+  // a cache hit or cached inputs are decoded only for an annotated image not written yet
+  bool annotate = params.write_images && access(outfile.c_str(), F_OK) != 0;
+  QGTensorCache::Entry entry;
+  uint64_t tensor_key = 0;
+  bool found = false, fed = false;
+  if (!hit && tensors)
+  {
+    tensor_key = tensors->key(bytesU, bytesD);
+    found = tensors->lookup(tensor_key, params.tensor_tag, entry);
+    // a pair classified under another detector needs its classifier input again, from a decode
+    if (found && !annotate && !entry.stale)
+    {
+      Leases leases = lease(worker);
+      fed = worker.grader->grade_inputs(entry.inputU, entry.inputD, entry.sizeU, entry.sizeD, entry.inputC, tensors->planar(), info);
+    }
+  }
+  bool decode = (!hit && !fed) || annotate;
+  cv::Mat imgU, imgD;
+  int scale = fed ? entry.scale : 1;
+  if (decode)
+  {
+    size_t decoded_bytes = 0;
+    if (!load(source, item.name, bytesU, bytesD, lot.archive && lot.archive->aligned(), imgU, imgD, scale, decoded_bytes))
+      return fail("decode");
+    worker.decoded++;
+    worker.decoded_bytes += decoded_bytes;
+    worker.decode_ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+  }
+  QGResults::Timings timings;
+  timings.decode_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+  // results and the caches hold full resolution coordinates
+  if (!hit)
+  {
+    if (fed)
+      worker.fed++;
+    else
+    {
+      Leases leases = lease(worker);
+      worker.grader->grade(imgU, imgD, info);
+      if (params.dparams.tile_size > 0)
+      {
+        QGDetector::add_tiles(worker.tiles, leases.detector->tile_stats());
+        leases.detector->reset_tile_stats();
+      }
+      // detector inputs are stored once, a classifier input that is now needed and missing is added to them
+      bool classified = !info.cinfos.empty() && !info.skipped;
+      if (tensors && (!found || (classified && !entry.inputC)))
+        store_inputs(*leases.detector, *leases.classifier, tensor_key, found ? &entry : nullptr, imgU, imgD, scale, info);
+    }
+    if (scale > 1)
+      QGGrader::rescale(info, scale);
+    if (cache)
+      cache->store(key, info);
+    timings.detect_ms = info.detect_ms;
+    timings.classify_ms = info.classify_ms;
+  }
+
+  if (decode && params.write_images)
+  {
+    std::string label = info.cinfos.empty() ? "NONE" : classify_labels[info.cinfos[0].labelid];
+    if (!info.cinfos.empty())
+    {
+      GradeInfo drawn = info;
+      QGGrader::rescale(drawn, 1.0f / scale);
+      cv::rectangle(imgU, drawn.ubox, crDetect);
+      cv::rectangle(imgD, drawn.dbox, crDetect);
+    }
+    cv::Mat result;
+    cv::hconcat(imgU, imgD, result);
+    cv::putText(result, label, cv::Point(30, 60), cv::FONT_HERSHEY_SIMPLEX, 1, crDetect, 2);
+    cv::imwrite(outfile, result);
+  }
+  timings.total_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+  if (results)
+    results->write(lot.name, item.name, info, timings, hit);
+  if (evaluator)
+    evaluator->add(lot.name, item.name, info, timings, hit);
+  finish(lot, item);
+  worker.processed++;
+
+  Timer::GetInstance().toc("total");
+}
+
+bool QGBatch::load(const std::string& source, const std::string& name, const std::vector<unsigned char>& bytesU,
+  const std::vector<unsigned char>& bytesD, bool aligned, cv::Mat& imgU, cv::Mat& imgD, int& scale, size_t& decoded_bytes)
+{
+  if (!bytesU.empty() && !bytesD.empty())
+  {
+    QGLoader::Params lparams;
+    // tiles are cut from the frame at full resolution, a reduced decode would leave a single tile
+    lparams.reduced = params.reduced_decode && params.dparams.tile_size == 0;
+    lparams.cropped = params.cropped_decode && !aligned;
+    lparams.aligned = aligned;
+    lparams.need = cv::Size(params.dparams.width, params.dparams.height);
+    return QGLoader::load_pair(lparams, bytesU, bytesD, imgU, imgD, scale, decoded_bytes);
+  }
+
+  scale = 1;
+  imgU = cv::imread(source + "/U/" + name);
+  imgD = cv::imread(source + "/D/" + name);
+  if (imgU.empty() || imgD.empty())
+    return false;
+  decoded_bytes = imgU.total() * imgU.elemSize() + imgD.total() * imgD.elemSize();
+  QGGrader::align(imgU, imgD);
+  return true;
+}
+
+void QGBatch::store_inputs(QGDetector& detector, QGClassifier& classifier, uint64_t key, const QGTensorCache::Entry* found,
+  const cv::Mat& imgU, const cv::Mat& imgD, int scale, const GradeInfo& info)
+{
+  // the inputs are exported straight into the mapping, detector inputs already cached are kept
+  QGTensorCache::Entry entry = found ? *found : QGTensorCache::Entry();
+  bool classified = !info.cinfos.empty() && !info.skipped;
+  if (!tensors->reserve(!found, classified, entry))
+    return;
+  if (!found)
+  {
+    entry.sizeU = imgU.size();
+    entry.sizeD = imgD.size();
+    entry.scale = scale;
+    detector.export_input(imgU, tensors->planar(), entry.inputU);
+    detector.export_input(imgD, tensors->planar(), entry.inputD);
+  }
+  if (classified)
+    classifier.export_input(info.infer, tensors->planar(), entry.inputC);
+  tensors->commit(key, params.tensor_tag, entry);
+}
+
+void QGBatch::finish(Lot& lot, const Item& item)
+{
+  {
+    std::lock_guard<std::mutex> guard(counts_lock);
+    counts.processed++;
+  }
+  if (!params.incremental)
+    return;
+
+  std::lock_guard<std::mutex> guard(lot.lock);
+  lot.manifest.record(item.name, item.entry);
+  if (--lot.remaining == 0)
+    lot.manifest.close();
+}
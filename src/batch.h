@@ -0,0 +1,144 @@
+#pragma once
+
+#include "detector.h"
+#include "classifier.h"
+#include "grader.h"
+#include "cache.h"
+#include "tensorcache.h"
+#include "results.h"
+#include "manifest.h"
+#include "archive.h"
+#include "evaluator.h"
+#include "pool.hpp"
+#include "reload.hpp"
+
+#include <opencv2/opencv.hpp>
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+// Images mode: grades every U/D pair of the lots under the input directory on a pool of workers.
+// Each worker owns a grader and leases detector and classifier sessions from pools sharing one
+// model load while it infers, lots are dealt out to the workers' queues and a worker whose
+// queue runs dry steals pairs from the back of another one.
+class QGBatch
+{
+public:
+  typedef struct Params
+  {
+    std::string input;    /* one subdirectory per lot, each with U and D, or one packed lot file per lot */
+    std::string outpath;  /* annotated images, one subdirectory per lot */
+    std::string manifest_dir;  /* lot manifests of incremental runs, kept across days */
+    int workers = 1;
+    int sessions = 0;  /* detector and classifier instances leased by the workers, 0 for one per worker */
+    int model_poll_ms = 0;  /* model files checked for a reload so often, 0 never */
+    bool write_images = false;
+    bool incremental = false;
+    bool reduced_decode = false;  /* JPEGs decoded at 1/2, 1/4 or 1/8 as far as the detector input allows */
+    bool cropped_decode = false;  /* JPEGs decoded only over the regions align() keeps */
+    int shard_index = 0;
+    int shard_count = 1;
+    uint64_t tensor_tag = 0;  /* detector model and settings the cached classifier inputs depend on */
+
+    std::string detector_path;
+    std::string classifier_path;
+    QGDetector::Params dparams;
+    QGClassifier::Params cparams;
+    QGGrader::Params gparams;
+    Params() {}
+  } Params;
+
+  typedef struct Stats
+  {
+    int listed = 0;
+    int unchanged = 0;  /* skipped by the manifests */
+    int unlabelled = 0;  /* skipped for want of ground truth when evaluating */
+    int processed = 0;
+    int failed = 0;
+    int stolen = 0;
+    double elapsed_ms = 0;
+  } Stats;
+
+protected:
+  typedef struct Item
+  {
+    int lot;
+    int index;  /* position in a packed lot */
+    std::string name;
+    QGManifest::Entry entry;
+  } Item;
+
+  typedef struct Lot
+  {
+    std::string name;
+    std::unique_ptr<QGArchive> archive;  /* null for a lot directory */
+    QGManifest manifest;
+    std::mutex lock;
+    std::atomic<int> remaining{ 0 };
+  } Lot;
+
+  typedef struct Worker
+  {
+    std::unique_ptr<QGGrader> grader;
+    std::deque<Item> queue;
+    std::mutex lock;
+    GradeInfo info;
+    int processed = 0;
+    int decoded = 0;
+    int fed = 0;  /* graded from the tensor cache */
+    double decode_ms = 0;
+    double decoded_bytes = 0;
+    QGDetector::TileStats tiles;  /* taken from the leased detectors after each tiled pair */
+  } Worker;
+
+  // the pools are held as long as their leases, a reload leaves them to the work in flight
+  typedef struct Leases
+  {
+    std::shared_ptr<QGDetectorPool> detectors;
+    std::shared_ptr<QGClassifierPool> classifiers;
+    QGDetectorPool::Lease detector;
+    QGClassifierPool::Lease classifier;
+  } Leases;
+
+public:
+  // caches, results and the evaluator are optional, shared by the workers.
+  QGBatch(const std::vector<std::string>& detect_labels, const std::vector<std::string>& classify_labels,
+    QGCache* cache = nullptr, QGResults* results = nullptr, QGTensorCache* tensors = nullptr, QGEvaluator* evaluator = nullptr);
+  int init(const Params& params);
+  int run();
+  const Stats& stats() const { return counts; }
+
+protected:
+  int list();
+  bool take(int worker, Item& item);
+  // sessions for one inference step, bound to the worker's grader until the leases go out of scope.
+  Leases lease(Worker& worker);
+  void grade(Worker& worker, const Item& item);
+  // decodes and aligns both views of a pair from their bytes, or from their files when not read,
+  // scale is the reduction applied.
+  bool load(const std::string& source, const std::string& name, const std::vector<unsigned char>& bytesU,
+    const std::vector<unsigned char>& bytesD, bool aligned, cv::Mat& imgU, cv::Mat& imgD, int& scale, size_t& decoded_bytes);
+  // stores the network inputs of a graded pair in the tensor cache, only the classifier input
+  // when found holds the detector ones.
+  void store_inputs(QGDetector& detector, QGClassifier& classifier, uint64_t key, const QGTensorCache::Entry* found,
+    const cv::Mat& imgU, const cv::Mat& imgD, int scale, const GradeInfo& info);
+  void finish(Lot& lot, const Item& item);
+
+private:
+  const std::vector<std::string>& detect_labels;
+  const std::vector<std::string>& classify_labels;
+  QGCache* cache;
+  QGResults* results;
+  QGTensorCache* tensors;
+  QGEvaluator* evaluator;
+
+  Params params;
+  QGReloader<QGDetectorPool> detectors;
+  QGReloader<QGClassifierPool> classifiers;
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::unique_ptr<Lot>> lots;
+  Stats counts;
+  std::mutex counts_lock;
+};
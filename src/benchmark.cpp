@@ -0,0 +1,407 @@
+#include "benchmark.h"
+#include "detector.h"
+#include "classifier.h"
+#include "loader.h"
+#include "dataset.hpp"
+#include "archive.h"
+
+#include <random>
+#include <chrono>
+#include <sstream>
+#include <atomic>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef QG_ALLOC_HOOK
+// counts every heap allocation of the process (opencv and mnn included) while enabled.
+static std::atomic<bool> alloc_counting(false);
+static std::atomic<long> alloc_count(0);
+
+extern "C"
+{
+  void* __libc_malloc(size_t size);
+  void* __libc_calloc(size_t num, size_t size);
+  void* __libc_realloc(void* ptr, size_t size);
+  void* __libc_memalign(size_t alignment, size_t size);
+
+  void* malloc(size_t size)
+  {
+    if (alloc_counting.load(std::memory_order_relaxed)) alloc_count++;
+    return __libc_malloc(size);
+  }
+  void* calloc(size_t num, size_t size)
+  {
+    if (alloc_counting.load(std::memory_order_relaxed)) alloc_count++;
+    return __libc_calloc(num, size);
+  }
+  void* realloc(void* ptr, size_t size)
+  {
+    if (alloc_counting.load(std::memory_order_relaxed)) alloc_count++;
+    return __libc_realloc(ptr, size);
+  }
+  void* memalign(size_t alignment, size_t size)
+  {
+    if (alloc_counting.load(std::memory_order_relaxed)) alloc_count++;
+    return __libc_memalign(alignment, size);
+  }
+  void* aligned_alloc(size_t alignment, size_t size)
+  {
+    if (alloc_counting.load(std::memory_order_relaxed)) alloc_count++;
+    return __libc_memalign(alignment, size);
+  }
+  int posix_memalign(void** ptr, size_t alignment, size_t size)
+  {
+    if (alloc_counting.load(std::memory_order_relaxed)) alloc_count++;
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+  }
+}
+#endif
+
+int QGBenchmark::run(const std::string& name, const std::string& data)
+{
+  if (name == "nms") return nms(data);
+  if (name == "alloc") return alloc(data);
+  if (name == "copy") return copy(data);
+  if (name == "decode") return decode(data);
+  if (name == "archive") return archive(data);
+
+  fprintf(stderr, "(!)----Error: unknown benchmark '%s'.\n", name.c_str());
+  return -1;
+}
+
+// the previous O(n^2) nms restricted to boxes of the same class, kept as reference.
+static std::vector<BoxInfo> nms_pairwise(std::vector<BoxInfo> inputs, float nms_threshold)
+{
+  std::vector<BoxInfo> outputs;
+  std::sort(inputs.begin(), inputs.end(), [](const BoxInfo& a, const BoxInfo& b) { return a.score > b.score; });
+  int box_num = inputs.size();
+  std::vector<int> merged(box_num, 0);
+
+  for (int i = 0; i < box_num; i++)
+  {
+    if (merged[i])
+      continue;
+    std::vector<BoxInfo> outs;
+
+    outs.push_back(inputs[i]);
+    merged[i] = 1;
+
+    float area0 = inputs[i].bbox.width * inputs[i].bbox.height;
+    for (int j = i + 1; j < box_num; j++)
+    {
+      if (merged[j] || inputs[j].labelid != inputs[i].labelid)
+        continue;
+
+      float inner_x0 = std::max(inputs[i].bbox.x, inputs[j].bbox.x);
+      float inner_y0 = std::max(inputs[i].bbox.y, inputs[j].bbox.y);
+      float inner_x1 = std::min(inputs[i].bbox.br().x, inputs[j].bbox.br().x);
+      float inner_y1 = std::min(inputs[i].bbox.br().y, inputs[j].bbox.br().y);
+      float inner_w = inner_x1 - inner_x0 + 1;
+      float inner_h = inner_y1 - inner_y0 + 1;
+      if (inner_h <= 0 || inner_w <= 0)
+        continue;
+
+      float inner_area = inner_h * inner_w;
+      float area1 = inputs[j].bbox.width * inputs[j].bbox.height;
+      if (inner_area / (area0 + area1 - inner_area) > nms_threshold)
+      {
+        merged[j] = 1;
+        outs.push_back(inputs[j]);
+      }
+    }
+    outputs.push_back(outs[0]);
+  }
+  return outputs;
+}
+
+// data: comma separated candidate counts, e.g. "100,1000,5000"
+int QGBenchmark::nms(const std::string& data)
+{
+  std::vector<int> counts;
+  std::stringstream ss(data.empty() ? "100,1000,5000,20000" : data);
+  for (std::string item; std::getline(ss, item, ',');)
+    counts.push_back(std::stoi(item));
+
+  QGDetector detector;
+  QGDetector::NmsScratch scratch;
+  std::mt19937 rng(0);
+  int failed = 0;
+  for (int count : counts)
+  {
+    // candidates cluster around beans spread over a 20 MP tray, like a low score threshold does.
+    std::uniform_int_distribution<int> center_x(0, 5472), center_y(0, 3648), jitter(-8, 8), size(60, 100), label(0, 1);
+    std::uniform_real_distribution<float> score(0.05f, 1.0f);
+    std::vector<BoxInfo> candidates;
+    int beans = std::max(1, count / 20);
+    for (int b = 0; b < beans; b++)
+    {
+      int cx = center_x(rng), cy = center_y(rng), w = size(rng), h = size(rng);
+      for (int k = 0; k < count / beans; k++)
+      {
+        BoxInfo box;
+        box.bbox = cv::Rect(cx + jitter(rng) - w / 2, cy + jitter(rng) - h / 2, w + jitter(rng), h + jitter(rng));
+        box.labelid = label(rng);
+        box.score = score(rng);
+        candidates.push_back(box);
+      }
+    }
+
+    int iterations = std::max(1, 200000 / (int)candidates.size());
+    std::vector<BoxInfo> reference, outputs, inputs;
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+    for (int it = 0; it < iterations; it++)
+      reference = nms_pairwise(candidates, detector.params.nms_threshold);
+    double pairwise = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count() / iterations;
+
+    for (int top_k : { 0, 300 })
+    {
+      detector.params.nms_top_k = top_k;
+      t0 = std::chrono::high_resolution_clock::now();
+      for (int it = 0; it < iterations; it++)
+      {
+        inputs = candidates;
+        detector.nms(inputs, outputs, detector.params.nms_threshold, scratch);
+      }
+      double sweep = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count() / iterations;
+
+      bool match = top_k > 0 || outputs.size() == reference.size();
+      failed += match ? 0 : 1;
+      printf("nms candidates: %6d, top_k: %3d, pairwise: %10.4f ms, sweep: %8.4f ms, speedup: %7.1fx, kept: %d/%d%s\n",
+        (int)candidates.size(), top_k, pairwise, sweep, pairwise / sweep, (int)outputs.size(), (int)reference.size(), match ? "" : " MISMATCH");
+    }
+  }
+  return failed;
+}
+
+// data: "detector.mnn,classifier.mnn", defaults to the models used by the grader.
+static void model_paths(const std::string& data, std::string& detector_path, std::string& classifier_path)
+{
+  detector_path = "models/coffee-detector.mnn";
+  classifier_path = "models/coffee-clssifier.mnn";
+  if (!data.empty())
+  {
+    detector_path = data.substr(0, data.find(','));
+    classifier_path = data.find(',') == std::string::npos ? classifier_path : data.substr(data.find(',') + 1);
+  }
+}
+
+int QGBenchmark::alloc(const std::string& data)
+{
+#ifndef QG_ALLOC_HOOK
+  fprintf(stderr, "(!)----Error: allocation counting needs a build with -DQG_ALLOC_HOOK=ON.\n");
+  return -1;
+#else
+  std::string detector_path, classifier_path;
+  model_paths(data, detector_path, classifier_path);
+
+  QGDetector::Params dparams;
+  dparams.num_classes = 2;
+  QGDetector detector;
+  QGClassifier::Params cparams;
+  cparams.num_classes = 11;
+  QGClassifier classifier;
+  if (!detector.init(detector_path, dparams) || !classifier.init(classifier_path, cparams))
+  {
+    fprintf(stderr, "(!)----Error: failed to load %s or %s.\n", detector_path.c_str(), classifier_path.c_str());
+    return -1;
+  }
+
+  cv::Mat frame(1824, 2736, CV_8UC3);
+  cv::randu(frame, cv::Scalar(0, 0, 0), cv::Scalar(255, 255, 255));
+  std::vector<BoxInfo> boxes;
+  std::vector<ClassInfo> classes;
+
+  // the first calls size the reusable buffers
+  for (int it = 0; it < 3; it++)
+  {
+    detector.detect(frame, boxes);
+    classifier.classify(frame, classes);
+  }
+
+  const int iterations = 20;
+  alloc_count = 0;
+  alloc_counting = true;
+  for (int it = 0; it < iterations; it++)
+  {
+    detector.detect(frame, boxes);
+    classifier.classify(frame, classes);
+  }
+  alloc_counting = false;
+
+  long count = alloc_count;
+  printf("alloc steady state: %d frames, %ld allocations (%.2f per frame)%s\n",
+    iterations, count, (double)count / iterations, count == 0 ? "" : " FAILED");
+  return count == 0 ? 0 : 1;
+#endif
+}
+
+// per head cost of reading the outputs: a fresh host tensor and copy per call as before,
+// against the in place read or the persistent host tensor chosen at init.
+static void copy_cost(const char* name, MNN::Tensor* tensor, const MNN::Tensor* read, MNN::Tensor* host)
+{
+  const int iterations = 200;
+  auto t0 = std::chrono::high_resolution_clock::now();
+  for (int it = 0; it < iterations; it++)
+  {
+    MNN::Tensor tensor_host(tensor, tensor->getDimensionType());
+    tensor->copyToHostTensor(&tensor_host);
+  }
+  double before = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - t0).count() / iterations;
+
+  t0 = std::chrono::high_resolution_clock::now();
+  for (int it = 0; it < iterations; it++)
+  {
+    if (read != tensor)
+      tensor->copyToHostTensor(host);
+  }
+  double after = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - t0).count() / iterations;
+
+  printf("copy %-10s %8d bytes, before: %9.3f us, after: %9.3f us (%s)\n",
+    name, tensor->size(), before, after, read == tensor ? "in place" : "host copy");
+}
+
+int QGBenchmark::copy(const std::string& data)
+{
+  std::string detector_path, classifier_path;
+  model_paths(data, detector_path, classifier_path);
+
+  QGDetector::Params dparams;
+  dparams.num_classes = 2;
+  QGDetector detector;
+  QGClassifier::Params cparams;
+  cparams.num_classes = 11;
+  QGClassifier classifier;
+  if (!detector.init(detector_path, dparams) || !classifier.init(classifier_path, cparams))
+  {
+    fprintf(stderr, "(!)----Error: failed to load %s or %s.\n", detector_path.c_str(), classifier_path.c_str());
+    return -1;
+  }
+
+  auto& context = detector.contexts[0];
+  for (size_t i = 0; i < detector.layers.size(); i++)
+    copy_cost(detector.layers[i].outputname.c_str(), context.outputs[i], context.reads[i], context.hosts[i].get());
+  copy_cost("classifier", classifier.output_tensor, classifier.output_read, classifier.output_host.get());
+  return 0;
+}
+
+int QGBenchmark::decode(const std::string& data)
+{
+  // data: lot directory[,pairs], the files are read up front so that only decoding is timed
+  std::string lot = data.substr(0, data.find(','));
+  int count = data.find(',') == std::string::npos ? 50 : std::max(1, atoi(data.substr(data.find(',') + 1).c_str()));
+  std::vector<std::string> names = listpairs(lot);
+  if (names.empty())
+  {
+    fprintf(stderr, "(!)----Error: no U/D pairs in %s.\n", lot.c_str());
+    return -1;
+  }
+  names.resize(std::min((int)names.size(), count));
+
+  std::vector<std::vector<unsigned char>> bytesU(names.size()), bytesD(names.size());
+  for (size_t i = 0; i < names.size(); i++)
+  {
+    if (!readfile(lot + "/U/" + names[i], bytesU[i]) || !readfile(lot + "/D/" + names[i], bytesD[i]))
+    {
+      fprintf(stderr, "(!)----Error: cannot read %s.\n", names[i].c_str());
+      return -1;
+    }
+  }
+
+  double full_ms = 0;
+  for (int mode = 0; mode < 4; mode++)
+  {
+    QGLoader::Params params;
+    params.reduced = mode & 1;
+    params.cropped = mode & 2;
+    cv::Mat imgU, imgD;
+    int scale = 1;
+    size_t decoded_bytes = 0, total_bytes = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < names.size(); i++)
+    {
+      if (!QGLoader::load_pair(params, bytesU[i], bytesD[i], imgU, imgD, scale, decoded_bytes))
+      {
+        fprintf(stderr, "(!)----Error: cannot decode %s.\n", names[i].c_str());
+        return -1;
+      }
+      total_bytes += decoded_bytes;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / names.size();
+    if (mode == 0)
+      full_ms = ms;
+    const char* modes[4] = { "full", "reduced", "cropped", "reduced+cropped" };
+    printf("    >>> decode %-16s %d pairs, %f ms per pair, %.1f pairs/s, speedup %.2fx, scale 1/%d, view %dx%d, decoded %.2f MB per pair\n",
+      modes[mode], (int)names.size(), ms, 1000.0 / ms, full_ms / ms, scale, imgU.cols, imgU.rows,
+      total_bytes / (double)names.size() / (1 << 20));
+  }
+  return 0;
+}
+
+// drops the clean page cache of a file, so that reads hit the storage again.
+static void drop_cached(const std::string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+int QGBenchmark::archive(const std::string& data)
+{
+  // data: lot directory,packed lot, both holding the same pairs
+  size_t comma = data.find(',');
+  if (comma == std::string::npos)
+  {
+    fprintf(stderr, "(!)----Error: archive benchmark data is <lot directory>,<packed lot>.\n");
+    return -1;
+  }
+  std::string lot = data.substr(0, comma), packed = data.substr(comma + 1);
+  std::vector<std::string> names = listpairs(lot);
+  for (const auto& name : names)
+  {
+    drop_cached(lot + "/U/" + name);
+    drop_cached(lot + "/D/" + name);
+  }
+  drop_cached(packed);
+
+  std::vector<unsigned char> bytesU, bytesD;
+  double loose_bytes = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (const auto& name : names)
+  {
+    if (!readfile(lot + "/U/" + name, bytesU) || !readfile(lot + "/D/" + name, bytesD))
+    {
+      fprintf(stderr, "(!)----Error: cannot read %s.\n", name.c_str());
+      return -1;
+    }
+    loose_bytes += bytesU.size() + bytesD.size();
+  }
+  double loose_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+  start = std::chrono::high_resolution_clock::now();
+  QGArchive archive;
+  if (!archive.open(packed))
+    return -1;
+  double packed_bytes = 0;
+  for (size_t i = 0; i < archive.pairs().size(); i++)
+  {
+    const QGArchive::Pair& pair = archive.pairs()[i];
+    archive.prefetch(i + 1);
+    bytesU.assign(pair.u, pair.u + pair.u_size);
+    bytesD.assign(pair.d, pair.d + pair.d_size);
+    packed_bytes += bytesU.size() + bytesD.size();
+  }
+  double packed_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+  printf("    >>> loose files: %d pairs, %f ms, %f ms per pair, %.1f MB/s\n", (int)names.size(), loose_ms,
+    names.empty() ? 0.0 : loose_ms / names.size(), loose_bytes / 1048576.0 / (loose_ms / 1000.0));
+  printf("    >>> packed lot:  %d pairs, %f ms, %f ms per pair, %.1f MB/s, speedup %.2fx\n", (int)archive.pairs().size(), packed_ms,
+    archive.pairs().empty() ? 0.0 : packed_ms / archive.pairs().size(), packed_bytes / 1048576.0 / (packed_ms / 1000.0), loose_ms / packed_ms);
+  return 0;
+}
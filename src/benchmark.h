@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+
+class QGBenchmark
+{
+public:
+  static int run(const std::string& name, const std::string& data);
+
+protected:
+  static int nms(const std::string& data);
+  static int alloc(const std::string& data);
+  static int copy(const std::string& data);
+  static int decode(const std::string& data);
+  static int archive(const std::string& data);
+};
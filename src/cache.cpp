@@ -0,0 +1,205 @@
+#include "cache.h"
+#include "hash.hpp"
+#include "dataset.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char CACHE_MAGIC[4] = { 'Q', 'G', 'R', 'C' };
+static const uint32_t CACHE_VERSION = 1;
+
+QGCache::~QGCache()
+{
+  if (header)
+    munmap(header, mapped_bytes);
+  if (fd >= 0)
+    close(fd);
+}
+
+int QGCache::init(const Params& params, uint64_t config)
+{
+  this->params = params;
+  this->config = config;
+
+  fd = open(params.path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+  {
+    fprintf(stderr, "(!)----Error: cannot open cache %s.\n", params.path.c_str());
+    return 0;
+  }
+
+  // an existing cache keeps its capacity, the size limit applies when it is created
+  Header existing = {};
+  struct stat st;
+  bool valid = fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Header)
+    && pread(fd, &existing, sizeof(Header), 0) == (ssize_t)sizeof(Header)
+    && !memcmp(existing.magic, CACHE_MAGIC, 4) && existing.version == CACHE_VERSION && existing.record_size == sizeof(Record)
+    && st.st_size == (off_t)(sizeof(Header) + existing.capacity * sizeof(Record));
+  uint64_t capacity = valid ? existing.capacity : (params.max_bytes > sizeof(Header) ? (params.max_bytes - sizeof(Header)) / sizeof(Record) : 0);
+  if (capacity == 0)
+  {
+    fprintf(stderr, "(!)----Error: cache size %zu bytes holds no record.\n", params.max_bytes);
+    return 0;
+  }
+
+  mapped_bytes = sizeof(Header) + capacity * sizeof(Record);
+  if (!valid && (ftruncate(fd, 0) != 0 || ftruncate(fd, mapped_bytes) != 0))
+  {
+    fprintf(stderr, "(!)----Error: cannot size cache %s.\n", params.path.c_str());
+    return 0;
+  }
+  void* mapped = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED)
+  {
+    fprintf(stderr, "(!)----Error: cannot map cache %s.\n", params.path.c_str());
+    return 0;
+  }
+  header = (Header*)mapped;
+  records = (Record*)(header + 1);
+  if (!valid)
+  {
+    // ftruncate zero filled the table, every slot is free
+    memcpy(header->magic, CACHE_MAGIC, 4);
+    header->version = CACHE_VERSION;
+    header->record_size = sizeof(Record);
+    header->capacity = capacity;
+    header->count = 0;
+  }
+  printf("(i)----cache %s: %llu of %llu records used\n", params.path.c_str(),
+    (unsigned long long)header->count, (unsigned long long)header->capacity);
+  return 1;
+}
+
+std::string QGCache::settings(const QGDetector::Params& dparams, const QGClassifier::Params& cparams, const QGGrader::Params& gparams)
+{
+  std::string text = cv::format("align %f %d %d\n", UD_SCALE, UD_TRANS[0], UD_TRANS[1]);
+  text += cv::format("detector %dx%d %d %d %d %f %f %d %d\n", dparams.width, dparams.height, dparams.num_classes,
+    dparams.forward_type, dparams.precision, dparams.score_threshold, dparams.nms_threshold, dparams.nms_top_k, dparams.max_detections);
+  text += cv::format("tiles %d %d %f\n", dparams.tile_size, dparams.tile_overlap, dparams.tile_merge_threshold);
+  text += "coarse";
+  for (int size : dparams.coarse_sizes)
+    text += cv::format(" %d", size);
+  text += cv::format(" %f\n", gparams.escalate_score);
+  text += cv::format("classifier %dx%d %d %d %d\n", cparams.width, cparams.height, cparams.num_classes, cparams.forward_type, cparams.precision);
+  text += cv::format("skip %d", gparams.skip_dry_run ? 1 : 0);
+  for (const auto& rule : gparams.skip_rules)
+    text += cv::format(" %d:%f:%d", rule.detect_label, rule.min_score, rule.classify_label);
+  return text + "\n";
+}
+
+bool QGCache::config_key(const std::vector<std::string>& model_paths, const std::string& settings, uint64_t& key)
+{
+  key = qg_hash64(settings);
+  std::vector<unsigned char> bytes;
+  for (const auto& path : model_paths)
+  {
+    if (!readfile(path, bytes))
+    {
+      fprintf(stderr, "(!)----Error: cannot read %s.\n", path.c_str());
+      return false;
+    }
+    key = qg_hash64(bytes.data(), bytes.size(), key);
+  }
+  return true;
+}
+
+uint64_t QGCache::key(const std::vector<unsigned char>& bytesU, const std::vector<unsigned char>& bytesD) const
+{
+  uint64_t key = qg_hash64(bytesD.data(), bytesD.size(), qg_hash64(bytesU.data(), bytesU.size(), config));
+  return key ? key : 1;
+}
+
+QGCache::Record* QGCache::find(uint64_t key) const
+{
+  // linear probing, the table is never filled beyond three quarters
+  uint64_t capacity = header->capacity;
+  for (uint64_t slot = key % capacity; ; slot = (slot + 1) % capacity)
+  {
+    Record* record = records + slot;
+    if (record->key == key || record->key == 0)
+      return record;
+  }
+}
+
+bool QGCache::lookup(uint64_t key, GradeInfo& info)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  const Record* record = find(key);
+  if (record->key != key)
+  {
+    counts.misses++;
+    return false;
+  }
+
+  info.udinfos.resize(record->udcount);
+  info.ddinfos.resize(record->ddcount);
+  for (int i = 0; i < record->udcount + record->ddcount; i++)
+  {
+    const auto& box = record->boxes[i];
+    BoxInfo& dinfo = i < record->udcount ? info.udinfos[i] : info.ddinfos[i - record->udcount];
+    dinfo.bbox = cv::Rect(box.x, box.y, box.width, box.height);
+    dinfo.labelid = box.labelid;
+    dinfo.score = box.score;
+  }
+  info.ubox = cv::Rect(record->ubox[0], record->ubox[1], record->ubox[2], record->ubox[3]);
+  info.dbox = cv::Rect(record->dbox[0], record->dbox[1], record->dbox[2], record->dbox[3]);
+  info.cinfos.resize(record->ccount);
+  for (int i = 0; i < record->ccount; i++)
+    info.cinfos[i] = { record->classes[i].labelid, record->classes[i].score };
+  info.skipped = record->skipped != 0;
+  counts.hits++;
+  return true;
+}
+
+void QGCache::store(uint64_t key, const GradeInfo& info)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (info.udinfos.size() + info.ddinfos.size() > MAX_BOXES || (header->count + 1) * 4 > header->capacity * 3)
+  {
+    counts.dropped++;
+    return;
+  }
+
+  Record* record = find(key);
+  bool fresh = record->key != key;
+  Record staged = {};
+  staged.udcount = info.udinfos.size();
+  staged.ddcount = info.ddinfos.size();
+  int i = 0;
+  for (const auto* dinfos : { &info.udinfos, &info.ddinfos })
+  {
+    for (const auto& dinfo : *dinfos)
+    {
+      auto& box = staged.boxes[i++];
+      box = { dinfo.bbox.x, dinfo.bbox.y, dinfo.bbox.width, dinfo.bbox.height, dinfo.labelid, dinfo.score };
+    }
+  }
+  int32_t ubox[4] = { info.ubox.x, info.ubox.y, info.ubox.width, info.ubox.height };
+  int32_t dbox[4] = { info.dbox.x, info.dbox.y, info.dbox.width, info.dbox.height };
+  memcpy(staged.ubox, ubox, sizeof(ubox));
+  memcpy(staged.dbox, dbox, sizeof(dbox));
+  staged.ccount = std::min((int)info.cinfos.size(), (int)MAX_CLASSES);
+  for (int c = 0; c < staged.ccount; c++)
+    staged.classes[c] = { info.cinfos[c].labelid, info.cinfos[c].score };
+  staged.skipped = info.skipped ? 1 : 0;
+
+  // the key goes in last, a run killed halfway leaves a free slot rather than a torn record
+  *record = staged;
+  __atomic_store_n(&record->key, key, __ATOMIC_RELEASE);
+  if (fresh)
+    header->count++;
+  counts.stored++;
+}
+
+void QGCache::report() const
+{
+  if (!header)
+    return;
+
+  int lookups = counts.hits + counts.misses;
+  printf("    >>> cache: %d hits, %d misses, hit rate %.1f%%, %d stored, %d not stored, %llu of %llu records used\n",
+    counts.hits, counts.misses, lookups ? 100.0 * counts.hits / lookups : 0.0, counts.stored, counts.dropped,
+    (unsigned long long)header->count, (unsigned long long)header->capacity);
+}
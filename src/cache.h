@@ -0,0 +1,86 @@
+#pragma once
+
+#include "grader.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+
+// Persistent grading results keyed on the contents of both views and on the configuration.
+// The file is a header followed by an open addressed table of fixed size records, it is
+// mapped as a whole and shared between runs, so a repeated run finds its pairs without
+// decoding or inferring them.
+class QGCache
+{
+public:
+  enum { MAX_BOXES = 32, MAX_CLASSES = 16 };
+
+  typedef struct Params
+  {
+    std::string path;
+    size_t max_bytes = 256 << 20;  /* file size when the cache is created */
+    Params() {}
+  } Params;
+
+  typedef struct Stats
+  {
+    int hits = 0;
+    int misses = 0;
+    int stored = 0;
+    int dropped = 0;  /* too many boxes for a record, or the table is full */
+  } Stats;
+
+protected:
+  typedef struct Header
+  {
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t count;
+    char padding[32];
+  } Header;
+
+  typedef struct Record
+  {
+    uint64_t key;  /* 0 marks a free slot */
+    int32_t udcount, ddcount, ccount, skipped;
+    int32_t ubox[4], dbox[4];
+    struct { int32_t x, y, width, height, labelid; float score; } boxes[MAX_BOXES];  /* U boxes then D boxes */
+    struct { int32_t labelid; float score; } classes[MAX_CLASSES];
+  } Record;
+
+public:
+  ~QGCache();
+  // maps the cache file, creating it when missing or written by another version.
+  // config is folded into every key, see config_key().
+  int init(const Params& params, uint64_t config);
+
+  // every option that changes the results, as text.
+  static std::string settings(const QGDetector::Params& dparams, const QGClassifier::Params& cparams, const QGGrader::Params& gparams);
+  // hash of the model files and of the settings.
+  static bool config_key(const std::vector<std::string>& model_paths, const std::string& settings, uint64_t& key);
+  uint64_t key(const std::vector<unsigned char>& bytesU, const std::vector<unsigned char>& bytesD) const;
+
+  // lookup() and store() may be called from several threads.
+  bool lookup(uint64_t key, GradeInfo& info);
+  void store(uint64_t key, const GradeInfo& info);
+
+  const Stats& stats() const { return counts; }
+  void report() const;
+
+protected:
+  Record* find(uint64_t key) const;
+
+private:
+  Params params;
+  uint64_t config = 0;
+  int fd = -1;
+  size_t mapped_bytes = 0;
+  Header* header = nullptr;
+  Record* records = nullptr;
+  Stats counts;
+  std::mutex lock;
+};
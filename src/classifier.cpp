@@ -1,11 +1,17 @@
 #include "classifier.h"
+#include "hosttensor.hpp"
+#include "backend.hpp"
+
+#include <chrono>
 
 QGClassifier::~QGClassifier()
 {
   if (interpreter)
   {
-    interpreter->releaseModel();
     interpreter->releaseSession(session);
+    // instances sharing the interpreter may still create or resize sessions on the model
+    if (interpreter.use_count() == 1)
+      interpreter->releaseModel();
   }
 }
 
@@ -15,58 +21,182 @@ int QGClassifier::init(std::string model_path, const Params& params)
   if (interpreter == nullptr) return 0;
 
   this->params = params;
-  MNN::ScheduleConfig schedule_config;
+  this->model_path = model_path;
+  if (!strcmp(forward_name(params.forward_type), "unknown") || !strcmp(precision_name(params.precision), "unknown")
+    || !strcmp(power_name(params.power), "unknown") || !strcmp(memory_name(params.memory), "unknown"))
+  {
+    fprintf(stderr, "(!)----Error: invalid backend options for %s.\n", model_path.c_str());
+    return 0;
+  }
+
+  schedule_config.type = params.forward_type;
   schedule_config.numThread = params.num_thread;
-  MNN::BackendConfig backend_config;
-  backend_config.precision = MNN::BackendConfig::Precision_Low;
+  backend_config.precision = params.precision;
+  backend_config.power = params.power;
+  backend_config.memory = params.memory;
+  schedule_config.backendConfig = &backend_config;
+  runtime = MNN::Interpreter::createRuntime({ schedule_config });
+  return init_session(true);
+}
+
+int QGClassifier::init(const QGClassifier& shared)
+{
+  if (!shared.initialized)
+  {
+    fprintf(stderr, "(!)----Error: model uninitialized.\n");
+    return 0;
+  }
+  interpreter = shared.interpreter;
+  params = shared.params;
+  model_path = shared.model_path;
+  schedule_config = shared.schedule_config;
+  backend_config = shared.backend_config;
   schedule_config.backendConfig = &backend_config;
+  runtime = shared.runtime;
+  return init_session(false);
+}
 
-  session = interpreter->createSession(schedule_config);
+int QGClassifier::init_session(bool check)
+{
+  session = interpreter->createSession(schedule_config, runtime);
+  if (session == nullptr) return 0;
+  if (check)
+    check_backend(model_path, interpreter.get(), session, schedule_config);
   input_tensor = interpreter->getSessionInput(session, nullptr);
 
   interpreter->resizeTensor(input_tensor, { 1, params.channel, params.height, params.width });
   interpreter->resizeSession(session);
   pretreat = std::shared_ptr<MNN::CV::ImageProcess>(MNN::CV::ImageProcess::create(MNN::CV::BGR, MNN::CV::RGB, mean_vals, 3, norm_vals, 3));
 
+  resized.create(params.height, params.width, CV_8UC3);
+  output_tensor = interpreter->getSessionOutput(session, "output");
+  output_host = host_tensor(output_tensor);
+
+  // the first run is timed on noise
+  cv::randu(resized, cv::Scalar(0, 0, 0), cv::Scalar(255, 255, 255));
+  pretreat->convert(resized.data, params.width, params.height, resized.step[0], input_tensor);
+  auto start = std::chrono::high_resolution_clock::now();
+  interpreter->runSession(session);
+  double first_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+  output_read = readable_in_place(output_tensor, output_host.get()) ? output_tensor : output_host.get();
+
+  warm_up(model_path, first_ms);
   initialized = true;
   return 1;
 };
 
+void QGClassifier::warm_up(const std::string& model_path, double first_ms)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+  std::vector<double> runs;
+  std::vector<ClassInfo> outputs;
+  for (int i = 0; i < params.warmup_runs; i++)
+  {
+    auto run_start = std::chrono::high_resolution_clock::now();
+    pretreat->convert(resized.data, params.width, params.height, resized.step[0], input_tensor);
+    interpreter->runSession(session);
+    if (output_read != output_tensor)
+      output_tensor->copyToHostTensor(output_host.get());
+    outputs.clear();
+    decode(*output_read, params.width, params.height, outputs);
+    runs.push_back(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - run_start).count());
+  }
+  if (runs.empty())
+  {
+    printf("(i)----warm-up %s %dx%d: first: %f ms\n", model_path.c_str(), params.width, params.height, first_ms);
+    return;
+  }
+  std::nth_element(runs.begin(), runs.begin() + runs.size() / 2, runs.end());
+  printf("(i)----warm-up %s %dx%d: first: %f ms, steady: %f ms (median of %d runs)\n", model_path.c_str(),
+    params.width, params.height, first_ms, runs[runs.size() / 2], (int)runs.size());
+  printf("(i)----classifier ready after %f ms of warm-up\n",
+    std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+}
+
 std::vector<ClassInfo> QGClassifier::classify(const cv::Mat& frame)
 {
+  std::vector<ClassInfo> outputs;
+  classify(frame, outputs);
+  return outputs;
+}
+
+void QGClassifier::classify(const cv::Mat& frame, std::vector<ClassInfo>& outputs)
+{
+  outputs.clear();
   if (!initialized)
   {
     fprintf(stderr, "(!)----Error: model uninitialized.\n");
-    return {};
+    return;
   }
   if (frame.empty())
   {
     fprintf(stderr, "(!)----Error: image is empty, please check!\n");
-    return {};
+    return;
   }
 
-  cv::Mat resized;
-  cv::resize(frame, resized, cv::Size(params.width, params.height));
+  cv::resize(frame, resized, resized.size());
   pretreat->convert(resized.data, params.width, params.height, resized.step[0], input_tensor);
 
   // run network
   interpreter->runSession(session);
 
   // get output data
-  MNN::Tensor* tensor = interpreter->getSessionOutput(session, "output");
-  MNN::Tensor tensor_host(tensor, tensor->getDimensionType());
-  tensor->copyToHostTensor(&tensor_host);
-  std::vector<ClassInfo> outputs = decode(tensor_host, frame.cols, frame.rows);
+  if (output_read != output_tensor)
+    output_tensor->copyToHostTensor(output_host.get());
+  decode(*output_read, frame.cols, frame.rows, outputs);
   std::sort(outputs.begin(), outputs.end(), [](const ClassInfo& a, const ClassInfo& b) { return a.score > b.score; });
-  return outputs;
 }
 
+size_t QGClassifier::input_bytes(bool planar) const
+{
+  return (size_t)params.width * params.height * params.channel * (planar ? sizeof(float) : 1);
+}
 
-std::vector<ClassInfo> QGClassifier::decode(MNN::Tensor& data, int width, int height)
+void QGClassifier::export_input(const cv::Mat& frame, bool planar, void* data)
 {
-  std::vector<ClassInfo> outputs;
+  cv::resize(frame, resized, resized.size());
+  if (!planar)
+  {
+    cv::Mat input(resized.size(), resized.type(), data);
+    resized.copyTo(input);
+    return;
+  }
+  pretreat->convert(resized.data, params.width, params.height, resized.step[0], input_tensor);
+  if (!input_host)
+    input_host = std::make_shared<MNN::Tensor>(input_tensor, MNN::Tensor::CAFFE);
+  input_tensor->copyToHostTensor(input_host.get());
+  memcpy(data, input_host->host<float>(), input_bytes(true));
+}
+
+void QGClassifier::classify_input(const void* data, bool planar, std::vector<ClassInfo>& outputs)
+{
+  outputs.clear();
+  if (!initialized)
+  {
+    fprintf(stderr, "(!)----Error: model uninitialized.\n");
+    return;
+  }
 
-  int num_classes = std::min(params.num_classes, data.shape()[1]);
+  if (!planar)
+    pretreat->convert((const uint8_t*)data, params.width, params.height, params.width * params.channel, input_tensor);
+  else
+  {
+    if (!input_host)
+      input_host = std::make_shared<MNN::Tensor>(input_tensor, MNN::Tensor::CAFFE);
+    memcpy(input_host->host<float>(), data, input_bytes(true));
+    input_tensor->copyFromHostTensor(input_host.get());
+  }
+  interpreter->runSession(session);
+
+  if (output_read != output_tensor)
+    output_tensor->copyToHostTensor(output_host.get());
+  decode(*output_read, params.width, params.height, outputs);
+  std::sort(outputs.begin(), outputs.end(), [](const ClassInfo& a, const ClassInfo& b) { return a.score > b.score; });
+}
+
+void QGClassifier::decode(const MNN::Tensor& data, int width, int height, std::vector<ClassInfo>& outputs)
+{
+  int num_classes = std::min(params.num_classes, data.length(1));
   auto data_ptr = data.host<float>();
   for (int id = 0; id < num_classes; id++)
   {
@@ -75,6 +205,5 @@ std::vector<ClassInfo> QGClassifier::decode(MNN::Tensor& data, int width, int he
     output.score = data_ptr[id];
     outputs.push_back(output);
   }
-  return outputs;
 }
 
@@ -25,6 +25,12 @@ public:
     int num_classes = 1000;
 
     int num_thread = 2;
+    MNNForwardType forward_type = MNN_FORWARD_CPU;
+    MNN::BackendConfig::PrecisionMode precision = MNN::BackendConfig::Precision_Low;
+    MNN::BackendConfig::PowerMode power = MNN::BackendConfig::Power_Normal;
+    MNN::BackendConfig::MemoryMode memory = MNN::BackendConfig::Memory_Normal;
+
+    int warmup_runs = 3;  /* inferences on noise at init, after the first one, before the classifier is ready */
     Params() {}
   } Params;
 
@@ -37,20 +43,44 @@ public:
 public:
   ~QGClassifier();
   int init(std::string model_path, const Params& params = Params());
+  // a session of its own on the model and runtime of an initialized classifier, without loading the model again.
+  int init(const QGClassifier& shared);
   std::vector<ClassInfo> classify(const cv::Mat& frame);
+  void classify(const cv::Mat& frame, std::vector<ClassInfo>& outputs);
+
+  // preprocessed input use, the resized bgr image or the planar float tensor, input_bytes() long
+  size_t input_bytes(bool planar) const;
+  void export_input(const cv::Mat& frame, bool planar, void* data);
+  void classify_input(const void* data, bool planar, std::vector<ClassInfo>& outputs);
 
 protected:
-  std::vector<ClassInfo> decode(MNN::Tensor& data, int width, int height);
+  int init_session(bool check);
+  // runs warmup_runs inferences and logs first and steady state latencies.
+  void warm_up(const std::string& model_path, double first_ms);
+  void decode(const MNN::Tensor& data, int width, int height, std::vector<ClassInfo>& outputs);
 
 private:
   std::shared_ptr<MNN::Interpreter> interpreter = nullptr;
+  std::string model_path;
+  MNN::ScheduleConfig schedule_config;
+  MNN::BackendConfig backend_config;
+  MNN::RuntimeInfo runtime;
   std::shared_ptr<MNN::CV::ImageProcess> pretreat = nullptr;
   MNN::Session* session = nullptr;
   MNN::Tensor* input_tensor = nullptr;
 
+  // per call buffers, allocated at init and reused across frames
+  cv::Mat resized;
+  MNN::Tensor* output_tensor = nullptr;
+  std::shared_ptr<MNN::Tensor> output_host = nullptr;
+  const MNN::Tensor* output_read = nullptr;  /* output itself when readable in place, its host copy otherwise */
+  std::shared_ptr<MNN::Tensor> input_host = nullptr;  /* planar input copy, created on first use */
+
   bool initialized = false;
   Params params;
 
+  friend class QGBenchmark;
+
   const float mean_vals[3] = { 127.5, 127.5, 127.5 };
   const float norm_vals[3] = { 1.0 / 127.5, 1.0 / 127.5, 1.0 / 127.5 };
 };
@@ -0,0 +1,74 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <cstring>
+
+#include "argparse.hpp"
+
+// Reads "key = value" lines of the file given with -c/--config and turns them into command line
+// options placed before the real ones, so that the command line overrides the file.
+// Keys are long option names without dashes, '#' starts a comment. A value is split on blanks
+// like on the command line, so a multi-value option takes "coarse_sizes = 320 480" and a value
+// cannot hold a blank. Flags can only be set: "true" sets one, "false" leaves it unset, and a
+// flag set on the command line cannot be cleared from the file. An option given on the command
+// line, by its long name or its short alias, replaces its line of the file rather than adding to
+// its values.
+inline std::vector<std::string> config_args(const ArgumentParser& parser, int argc, const char** argv)
+{
+  std::vector<std::string> args(argv, argv + 1);
+  std::set<std::string> given;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string name = parser.canonical(argv[i]);
+    if (!name.empty())
+      given.insert(name);
+  }
+  for (int i = 1; i + 1 < argc; i++)
+  {
+    if (strcmp(argv[i], "-c") && strcmp(argv[i], "--config"))
+      continue;
+
+    std::ifstream file(argv[i + 1]);
+    if (!file.is_open())
+    {
+      fprintf(stderr, "(!)----Error: cannot open config file %s.\n", argv[i + 1]);
+      exit(-1);
+    }
+
+    auto trim = [](const std::string& s)
+    {
+      size_t begin = s.find_first_not_of(" \t\r");
+      size_t end = s.find_last_not_of(" \t\r");
+      return begin == std::string::npos ? std::string() : s.substr(begin, end - begin + 1);
+    };
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+      line = trim(line.substr(0, line.find('#')));
+      size_t eq = line.find('=');
+      if (line.empty() || eq == std::string::npos)
+        continue;
+
+      std::string key = trim(line.substr(0, eq)), value = trim(line.substr(eq + 1));
+      if (value == "false" || given.count(parser.canonical("--" + key)))
+        continue;
+      args.push_back("--" + key);
+      if (value == "true")
+        continue;
+      std::istringstream words(value);
+      std::string word;
+      while (words >> word)
+        args.push_back(word);
+    }
+  }
+  args.insert(args.end(), argv + 1, argv + argc);
+  return args;
+}
+
+#endif //CONFIG_H
@@ -0,0 +1,66 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <vector>
+#include <string>
+#include <set>
+#include <algorithm>
+#include <iterator>
+#include <string.h>
+#include <stdio.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+inline std::vector<std::string> getlistdir(const std::string& path, unsigned int st_mode)
+{
+  std::vector<std::string> list;
+  struct dirent* dir;
+  DIR* d;
+  struct stat st;
+  if (d = opendir(path.c_str()))
+  {
+    while (dir = readdir(d))
+    {
+      const char* name = dir->d_name;
+      if (stat((path + "/" + name).c_str(), &st) == 0 && (st.st_mode & st_mode) && ((st.st_mode & S_IFDIR) != S_IFDIR || (strcmp(name, ".") && strcmp(name, ".."))))
+        list.push_back(name);
+    }
+    closedir(d);
+  }
+  return list;
+}
+
+// file names present in both the U and D views of a lot, sorted.
+inline std::vector<std::string> listpairs(const std::string& lot)
+{
+  std::vector<std::string> imv1 = getlistdir(lot + "/U", S_IFREG);
+  std::vector<std::string> imv2 = getlistdir(lot + "/D", S_IFREG);
+
+  std::set<std::string> ims1(std::make_move_iterator(imv1.begin()), std::make_move_iterator(imv1.end()));
+  std::set<std::string> ims2(std::make_move_iterator(imv2.begin()), std::make_move_iterator(imv2.end()));
+  std::vector<std::string> pairs;
+  std::set_intersection(ims1.begin(), ims1.end(), ims2.begin(), ims2.end(), std::back_inserter(pairs));
+  return pairs;
+}
+
+// whole file contents, false when it cannot be read.
+inline bool readfile(const std::string& path, std::vector<unsigned char>& bytes)
+{
+  bytes.clear();
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if (size > 0)
+  {
+    bytes.resize(size);
+    bytes.resize(fread(bytes.data(), 1, size, file));
+  }
+  fclose(file);
+  return size >= 0 && bytes.size() == (size_t)size;
+}
+
+#endif //DATASET_H
@@ -1,11 +1,23 @@
 #include "detector.h"
+#include "hosttensor.hpp"
+#include "backend.hpp"
+#include "kernels.h"
+
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 QGDetector::~QGDetector()
 {
   if (interpreter)
   {
-    interpreter->releaseModel();
-    interpreter->releaseSession(session);
+    for (auto& context : contexts)
+      interpreter->releaseSession(context.session);
+    for (auto& context : coarse)
+      interpreter->releaseSession(context.session);
+    // instances sharing the interpreter may still create or resize sessions on the model
+    if (interpreter.use_count() == 1)
+      interpreter->releaseModel();
   }
 }
 
@@ -15,54 +27,458 @@ int QGDetector::init(std::string model_path, const Params& params)
   if (interpreter == nullptr) return 0;
 
   this->params = params;
-  MNN::ScheduleConfig schedule_config;
+  this->model_path = model_path;
+  if (!strcmp(forward_name(params.forward_type), "unknown") || !strcmp(precision_name(params.precision), "unknown")
+    || !strcmp(power_name(params.power), "unknown") || !strcmp(memory_name(params.memory), "unknown"))
+  {
+    fprintf(stderr, "(!)----Error: invalid backend options for %s.\n", model_path.c_str());
+    return 0;
+  }
+
+  schedule_config.type = params.forward_type;
   schedule_config.numThread = params.num_thread;
-  MNN::BackendConfig backend_config;
-  backend_config.precision = MNN::BackendConfig::Precision_Low;
+  backend_config.precision = params.precision;
+  backend_config.power = params.power;
+  backend_config.memory = params.memory;
   schedule_config.backendConfig = &backend_config;
+  runtime = MNN::Interpreter::createRuntime({ schedule_config });
+  return init_sessions(true);
+}
 
-  session = interpreter->createSession(schedule_config);
-  input_tensor = interpreter->getSessionInput(session, nullptr);
+int QGDetector::init(const QGDetector& shared)
+{
+  if (!shared.initialized)
+  {
+    fprintf(stderr, "(!)----Error: model uninitialized.\n");
+    return 0;
+  }
+  interpreter = shared.interpreter;
+  params = shared.params;
+  model_path = shared.model_path;
+  schedule_config = shared.schedule_config;
+  backend_config = shared.backend_config;
+  schedule_config.backendConfig = &backend_config;
+  runtime = shared.runtime;
+  return init_sessions(false);
+}
 
-  interpreter->resizeTensor(input_tensor, { 1, params.channel, params.height, params.width });
-  interpreter->resizeSession(session);
-  pretreat = std::shared_ptr<MNN::CV::ImageProcess>(MNN::CV::ImageProcess::create(MNN::CV::BGR, MNN::CV::RGB, nullptr, 0, norm_vals, 3));
+int QGDetector::init_sessions(bool check)
+{
+  // tile workers and input buffers run their own sessions on a runtime shared with the primary one
+  int num_contexts = std::max(1, params.num_buffers);
+  if (params.tile_size > 0)
+    num_contexts = std::max(num_contexts, params.tile_threads);
+  params.num_buffers = std::max(1, params.num_buffers);
+  contexts.resize(num_contexts);
+  for (auto& context : contexts)
+  {
+    if (!init_context(context, cv::Size(params.width, params.height), schedule_config, runtime)) return 0;
+    if (check && &context == &contexts[0])
+      check_backend(model_path, interpreter.get(), context.session, schedule_config);
+  }
 
+  std::vector<int> sizes = params.coarse_sizes;
+  std::sort(sizes.begin(), sizes.end());
+  sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+  int max_stride = 0;
+  for (const auto& layer : layers)
+    max_stride = std::max(max_stride, layer.stride);
+  for (int size : sizes)
+  {
+    if (size <= 0 || size % max_stride || size >= std::min(params.width, params.height))
+    {
+      fprintf(stderr, "(!)----Error: coarse size %d must be a multiple of %d below %dx%d.\n", size, max_stride, params.width, params.height);
+      return 0;
+    }
+    coarse.emplace_back();
+    if (!init_context(coarse.back(), cv::Size(size, size), schedule_config, runtime)) return 0;
+  }
+  params.coarse_sizes = sizes;
+
+  warm_up(model_path);
   initialized = true;
   return 1;
 };
 
+void QGDetector::warm_up(const std::string& model_path)
+{
+  // every session is warmed on its own, each one grows its own buffers on its first runs,
+  // sessions of one input size share a log line
+  auto start = std::chrono::high_resolution_clock::now();
+  std::vector<std::vector<Context*>> groups(1);
+  for (auto& context : contexts)
+    groups[0].push_back(&context);
+  for (auto& context : coarse)
+    groups.push_back({ &context });
+  for (const auto& group : groups)
+  {
+    double first_ms = 0;
+    std::vector<double> runs;
+    for (Context* context : group)
+    {
+      first_ms = std::max(first_ms, context->first_ms);
+      for (int i = 0; i < params.warmup_runs; i++)
+      {
+        auto run_start = std::chrono::high_resolution_clock::now();
+        context->pretreat->convert(context->resized.data, context->input_size.width, context->input_size.height, context->resized.step[0], context->input_tensor);
+        context->frame_size = context->input_size;
+        forward(*context, context->candidates);
+        runs.push_back(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - run_start).count());
+      }
+    }
+    const cv::Size& size = group[0]->input_size;
+    if (runs.empty())
+    {
+      printf("(i)----warm-up %s %dx%d x %d sessions: first: %f ms\n", model_path.c_str(), size.width, size.height, (int)group.size(), first_ms);
+      continue;
+    }
+    std::nth_element(runs.begin(), runs.begin() + runs.size() / 2, runs.end());
+    printf("(i)----warm-up %s %dx%d x %d sessions: first: %f ms, steady: %f ms (median of %d runs)\n", model_path.c_str(),
+      size.width, size.height, (int)group.size(), first_ms, runs[runs.size() / 2], (int)runs.size());
+  }
+  printf("(i)----detector ready after %f ms of warm-up\n",
+    std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+}
+
+int QGDetector::init_context(Context& context, const cv::Size& input_size, const MNN::ScheduleConfig& config, const MNN::RuntimeInfo& runtime)
+{
+  context.session = interpreter->createSession(config, runtime);
+  if (context.session == nullptr) return 0;
+  context.input_tensor = interpreter->getSessionInput(context.session, nullptr);
+
+  interpreter->resizeTensor(context.input_tensor, { 1, params.channel, input_size.height, input_size.width });
+  interpreter->resizeSession(context.session);
+  context.pretreat = std::shared_ptr<MNN::CV::ImageProcess>(MNN::CV::ImageProcess::create(MNN::CV::BGR, MNN::CV::RGB, nullptr, 0, norm_vals, 3));
+
+  context.input_size = input_size;
+  context.resized.create(input_size, CV_8UC3);
+  for (const auto& layer : layers)
+  {
+    MNN::Tensor* tensor = interpreter->getSessionOutput(context.session, layer.outputname.c_str());
+    context.outputs.push_back(tensor);
+    context.hosts.push_back(host_tensor(tensor));
+  }
+
+  // heads kept on the host in the layout of their copy skip it, the first run is timed on noise
+  cv::randu(context.resized, cv::Scalar(0, 0, 0), cv::Scalar(255, 255, 255));
+  context.pretreat->convert(context.resized.data, input_size.width, input_size.height, context.resized.step[0], context.input_tensor);
+  auto start = std::chrono::high_resolution_clock::now();
+  interpreter->runSession(context.session);
+  context.first_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+  for (size_t i = 0; i < layers.size(); i++)
+  {
+    bool in_place = readable_in_place(context.outputs[i], context.hosts[i].get());
+    context.reads.push_back(in_place ? context.outputs[i] : context.hosts[i].get());
+  }
+
+  context.candidates.reserve(1024);
+  context.confidences.resize(input_size.width);
+  NmsScratch& scratch = context.nms_scratch;
+  for (auto* buffer : { &scratch.order, &scratch.position })
+    buffer->reserve(1024);
+  for (auto* buffer : { &scratch.x0, &scratch.y0, &scratch.x1, &scratch.y1, &scratch.area })
+    buffer->reserve(1024);
+  for (auto* buffer : { &scratch.merged, &scratch.over })
+    buffer->reserve(1024);
+  return 1;
+}
+
 std::vector<BoxInfo> QGDetector::detect(const cv::Mat& frame)
 {
+  std::vector<BoxInfo> outputs;
+  detect(frame, outputs);
+  return outputs;
+}
+
+void QGDetector::detect(const cv::Mat& frame, std::vector<BoxInfo>& outputs)
+{
+  outputs.clear();
   if (!initialized)
   {
     fprintf(stderr, "(!)----Error: model uninitialized.\n");
-    return {};
+    return;
   }
   if (frame.empty())
   {
     fprintf(stderr, "(!)----Error: image is empty, please check!\n");
-    return {};
+    return;
+  }
+
+  if (params.tile_size > 0 && (frame.cols > params.tile_size || frame.rows > params.tile_size))
+    return detect_tiled(frame, outputs);
+
+  Context& context = contexts[0];
+  infer(context, frame, context.candidates);
+  nms(context.candidates, outputs, params.nms_threshold, context.nms_scratch);
+}
+
+cv::Size QGDetector::input_size(int level) const
+{
+  if (level >= 0 && level < (int)coarse.size())
+    return coarse[level].input_size;
+  return cv::Size(params.width, params.height);
+}
+
+void QGDetector::detect(const cv::Mat& frame, std::vector<BoxInfo>& outputs, int level)
+{
+  if (level < 0 || level >= (int)coarse.size())
+    return detect(frame, outputs);
+
+  outputs.clear();
+  if (!initialized || frame.empty())
+  {
+    fprintf(stderr, "(!)----Error: model uninitialized or image is empty, please check!\n");
+    return;
+  }
+
+  Context& context = coarse[level];
+  infer(context, frame, context.candidates);
+  nms(context.candidates, outputs, params.nms_threshold, context.nms_scratch);
+}
+
+bool QGDetector::prepare(const cv::Mat& frame, int buffer)
+{
+  if (!initialized || frame.empty() || buffer < 0 || buffer >= params.num_buffers)
+  {
+    fprintf(stderr, "(!)----Error: cannot prepare buffer %d, please check!\n", buffer);
+    return false;
+  }
+  if (params.tile_size > 0 && (frame.cols > params.tile_size || frame.rows > params.tile_size))
+  {
+    fprintf(stderr, "(!)----Error: tiled frames cannot be prepared, use detect().\n");
+    return false;
   }
 
-  cv::Mat resized;
-  cv::resize(frame, resized, cv::Size(params.width, params.height));
-  pretreat->convert(resized.data, params.width, params.height, resized.step[0], input_tensor);
+  preprocess(contexts[buffer], frame);
+  return true;
+}
+
+void QGDetector::run(int buffer, std::vector<BoxInfo>& outputs)
+{
+  Context& context = contexts[buffer];
+  forward(context, context.candidates);
+  nms(context.candidates, outputs, params.nms_threshold, context.nms_scratch);
+}
+
+size_t QGDetector::input_bytes(bool planar) const
+{
+  return (size_t)params.width * params.height * params.channel * (planar ? sizeof(float) : 1);
+}
+
+void QGDetector::export_input(const cv::Mat& frame, bool planar, void* data)
+{
+  Context& context = contexts[0];
+  preprocess(context, frame);
+  if (!planar)
+  {
+    cv::Mat input(context.resized.size(), context.resized.type(), data);
+    context.resized.copyTo(input);
+    return;
+  }
+  if (!context.input_host)
+    context.input_host = std::make_shared<MNN::Tensor>(context.input_tensor, MNN::Tensor::CAFFE);
+  context.input_tensor->copyToHostTensor(context.input_host.get());
+  memcpy(data, context.input_host->host<float>(), input_bytes(true));
+}
+
+void QGDetector::detect_input(const void* data, bool planar, const cv::Size& frame_size, std::vector<BoxInfo>& outputs)
+{
+  outputs.clear();
+  if (!initialized)
+  {
+    fprintf(stderr, "(!)----Error: model uninitialized.\n");
+    return;
+  }
+
+  Context& context = contexts[0];
+  if (!planar)
+    context.pretreat->convert((const uint8_t*)data, params.width, params.height, params.width * params.channel, context.input_tensor);
+  else
+  {
+    if (!context.input_host)
+      context.input_host = std::make_shared<MNN::Tensor>(context.input_tensor, MNN::Tensor::CAFFE);
+    memcpy(context.input_host->host<float>(), data, input_bytes(true));
+    context.input_tensor->copyFromHostTensor(context.input_host.get());
+  }
+  context.frame_size = frame_size;
+  forward(context, context.candidates);
+  nms(context.candidates, outputs, params.nms_threshold, context.nms_scratch);
+}
 
+void QGDetector::infer(Context& context, const cv::Mat& frame, std::vector<BoxInfo>& boxes)
+{
+  preprocess(context, frame);
+  forward(context, boxes);
+}
+
+void QGDetector::preprocess(Context& context, const cv::Mat& frame)
+{
+  cv::resize(frame, context.resized, context.resized.size());
+  context.pretreat->convert(context.resized.data, context.input_size.width, context.input_size.height, context.resized.step[0], context.input_tensor);
+  context.frame_size = frame.size();
+}
+
+void QGDetector::forward(Context& context, std::vector<BoxInfo>& boxes)
+{
   // run network
-  interpreter->runSession(session);
+  interpreter->runSession(context.session);
 
   // get output data
+  boxes.clear();
+  for (size_t i = 0; i < layers.size(); i++)
+  {
+    if (context.reads[i] != context.outputs[i])
+      context.outputs[i]->copyToHostTensor(context.hosts[i].get());
+    decode(*context.reads[i], layers[i].stride, layers[i].anchors, context.input_size, context.frame_size, context.confidences.data(), boxes);
+  }
+}
+
+std::vector<cv::Rect> QGDetector::make_tiles(const cv::Size& size) const
+{
+  // tiles are laid out on a regular grid, the last row and column are shifted back
+  // so that every tile keeps the full tile size and the frame border is covered.
+  auto positions = [](int length, int tile, int overlap)
+  {
+    std::vector<int> starts;
+    if (length <= tile)
+    {
+      starts.push_back(0);
+      return starts;
+    }
+    int step = std::max(1, tile - overlap);
+    for (int pos = 0; ; pos += step)
+    {
+      starts.push_back(std::min(pos, length - tile));
+      if (pos + tile >= length) break;
+    }
+    return starts;
+  };
+
+  int tile = params.tile_size;
+  int overlap = params.tile_overlap;
+  std::vector<cv::Rect> tiles;
+  for (int y : positions(size.height, tile, overlap))
+    for (int x : positions(size.width, tile, overlap))
+      tiles.push_back(cv::Rect(x, y, std::min(tile, size.width), std::min(tile, size.height)));
+  return tiles;
+}
+
+void QGDetector::detect_tiled(const cv::Mat& frame, std::vector<BoxInfo>& outputs)
+{
+  std::vector<cv::Rect> tiles = make_tiles(frame.size());
+  std::vector<std::vector<BoxInfo>> results(tiles.size());
+  std::vector<double> elapsed(tiles.size(), 0.0);
+
+  auto t0 = std::chrono::high_resolution_clock::now();
+  std::atomic<int> next(0);
+  auto work = [&](Context& context)
+  {
+    for (int i = next++; i < (int)tiles.size(); i = next++)
+    {
+      auto start = std::chrono::high_resolution_clock::now();
+      infer(context, frame(tiles[i]), results[i]);
+      for (auto& box : results[i])
+      {
+        box.bbox.x += tiles[i].x;
+        box.bbox.y += tiles[i].y;
+      }
+      elapsed[i] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+  };
+
+  int workers = std::min((int)contexts.size(), (int)tiles.size());
+  std::vector<std::thread> threads;
+  for (int i = 1; i < workers; i++)
+    threads.emplace_back(work, std::ref(contexts[i]));
+  work(contexts[0]);
+  for (auto& thread : threads)
+    thread.join();
+
   std::vector<BoxInfo> boxes;
-  for (auto layer : layers)
+  for (auto& result : results)
+    boxes.insert(boxes.end(), result.begin(), result.end());
+  nms(boxes, outputs, params.nms_threshold, contexts[0].nms_scratch);
+  outputs = merge_seams(outputs, tiles, frame.size(), params.tile_merge_threshold);
+
+  tile_counts.frames++;
+  tile_counts.tiles += (int)tiles.size();
+  tile_counts.workers = std::max(tile_counts.workers, workers);
+  for (double ms : elapsed)
+  {
+    tile_counts.tile_ms += ms;
+    tile_counts.max_tile_ms = std::max(tile_counts.max_tile_ms, ms);
+  }
+  tile_counts.elapsed_ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+}
+
+void QGDetector::add_tiles(TileStats& total, const TileStats& stats)
+{
+  total.frames += stats.frames;
+  total.tiles += stats.tiles;
+  total.workers = std::max(total.workers, stats.workers);
+  total.tile_ms += stats.tile_ms;
+  total.max_tile_ms = std::max(total.max_tile_ms, stats.max_tile_ms);
+  total.elapsed_ms += stats.elapsed_ms;
+}
+
+void QGDetector::report_tiles(const TileStats& stats)
+{
+  if (stats.frames == 0)
+    return;
+  printf("    >>> tiles: %d frames, %.1f tiles per frame (%d workers), tile mean: %f ms, tile max: %f ms, frame mean: %f ms\n",
+    stats.frames, (double)stats.tiles / stats.frames, stats.workers, stats.tile_ms / stats.tiles, stats.max_tile_ms,
+    stats.elapsed_ms / stats.frames);
+}
+
+std::vector<BoxInfo> QGDetector::merge_seams(std::vector<BoxInfo>& inputs, const std::vector<cv::Rect>& tiles, const cv::Size& frame_size, float merge_threshold)
+{
+  // a bean crossing a tile seam is seen as two partial boxes whose IoU is too low for nms,
+  // but one of them is mostly contained in the other one. only boxes reaching within the
+  // overlap of a tile edge inside the frame can be such halves, beans elsewhere are kept apart.
+  std::vector<int> seams_x, seams_y;
+  for (const auto& tile : tiles)
+  {
+    if (tile.x > 0) seams_x.push_back(tile.x);
+    if (tile.x + tile.width < frame_size.width) seams_x.push_back(tile.x + tile.width);
+    if (tile.y > 0) seams_y.push_back(tile.y);
+    if (tile.y + tile.height < frame_size.height) seams_y.push_back(tile.y + tile.height);
+  }
+  int margin = params.tile_overlap;
+  auto near = [margin](const std::vector<int>& seams, int low, int high)
+  {
+    for (int seam : seams)
+      if (std::abs(low - seam) <= margin || std::abs(high - seam) <= margin)
+        return true;
+    return false;
+  };
+  auto cut = [&](const cv::Rect& box)
   {
-    MNN::Tensor* tensor = interpreter->getSessionOutput(session, layer.outputname.c_str());
-    MNN::Tensor tensor_host(tensor, tensor->getDimensionType());
-    tensor->copyToHostTensor(&tensor_host);
-    std::vector<BoxInfo> outputs = decode(tensor_host, layer.stride, layer.anchors, frame.cols, frame.rows);
-    boxes.insert(boxes.end(), outputs.begin(), outputs.end());
+    return near(seams_x, box.x, box.x + box.width) || near(seams_y, box.y, box.y + box.height);
+  };
+
+  std::sort(inputs.begin(), inputs.end(), [](const BoxInfo& a, const BoxInfo& b) { return a.score > b.score; });
+  std::vector<BoxInfo> outputs;
+  for (const auto& input : inputs)
+  {
+    bool merged = false;
+    bool input_cut = cut(input.bbox);
+    for (auto& output : outputs)
+    {
+      if (output.labelid != input.labelid || (!input_cut && !cut(output.bbox)))
+        continue;
+      float inner_area = (output.bbox & input.bbox).area();
+      float min_area = std::min(output.bbox.area(), input.bbox.area());
+      if (min_area > 0 && inner_area / min_area > merge_threshold)
+      {
+        output.bbox |= input.bbox;
+        merged = true;
+        break;
+      }
+    }
+    if (!merged)
+      outputs.push_back(input);
   }
-  return nms(boxes, params.nms_threshold);
+  return outputs;
 }
 
 
@@ -80,15 +496,16 @@ inline float sigmoid(float x)
 {
   return 1.0f / (1.0f + fast_exp(-x));
 }
-std::vector<BoxInfo> QGDetector::decode(MNN::Tensor& data, int stride, std::vector<Yolov5LayerData::Anchor> anchors, int width, int height)
+void QGDetector::decode(const MNN::Tensor& data, int stride, const std::vector<Yolov5LayerData::Anchor>& anchors, const cv::Size& input_size, const cv::Size& frame_size, float* confidences, std::vector<BoxInfo>& outputs)
 {
-  std::vector<BoxInfo> outputs;
+  const QGKernels& kernels = qg_kernels();
+  int width = frame_size.width, height = frame_size.height;
 
-  int batch = data.shape()[0];
-  int channels = data.shape()[1];
-  int dh = data.shape()[2];
-  int dw = data.shape()[3];
-  int preds = data.shape()[4];
+  int batch = data.length(0);
+  int channels = data.length(1);
+  int dh = data.length(2);
+  int dw = data.length(3);
+  int preds = data.length(4);
 
   auto data_ptr = data.host<float>();
   for (int b = 0; b < batch; b++)
@@ -100,22 +517,26 @@ std::vector<BoxInfo> QGDetector::decode(MNN::Tensor& data, int stride, std::vect
       for (int h = 0; h < dh; h++)
       {
         auto height_ptr = channel_ptr + h * (dw * preds);
+        kernels.sigmoid_strided(height_ptr + 4, preds, dw, confidences);
         for (int w = 0; w < dw; w++)
         {
+          // class scores are bounded by the objectness
+          auto confidence = confidences[w];
+          if (confidence <= params.score_threshold)
+            continue;
+
           auto width_ptr = height_ptr + w * preds;
           auto cls_ptr = width_ptr + 5;
 
-          auto confidence = sigmoid(width_ptr[4]);
-
           for (int id = 0; id < params.num_classes; id++)
           {
             float score = sigmoid(cls_ptr[id]) * confidence;
             if (score > params.score_threshold)
             {
-              float cx = (sigmoid(width_ptr[0]) * 2.f - 0.5f + w) * (float)stride / params.width;
-              float cy = (sigmoid(width_ptr[1]) * 2.f - 0.5f + h) * (float)stride / params.height;
-              float sw = pow(sigmoid(width_ptr[2]) * 2.f, 2) * anchors[c].width / params.width;
-              float sh = pow(sigmoid(width_ptr[3]) * 2.f, 2) * anchors[c].height / params.height;
+              float cx = (sigmoid(width_ptr[0]) * 2.f - 0.5f + w) * (float)stride / input_size.width;
+              float cy = (sigmoid(width_ptr[1]) * 2.f - 0.5f + h) * (float)stride / input_size.height;
+              float sw = pow(sigmoid(width_ptr[2]) * 2.f, 2) * anchors[c].width / input_size.width;
+              float sh = pow(sigmoid(width_ptr[3]) * 2.f, 2) * anchors[c].height / input_size.height;
 
               BoxInfo output;
               output.bbox.x = (cx - sw / 2.f) * width;
@@ -132,89 +553,119 @@ std::vector<BoxInfo> QGDetector::decode(MNN::Tensor& data, int stride, std::vect
       }
     }
   }
-
-  return outputs;
 }
 
-std::vector<BoxInfo> QGDetector::nms(std::vector<BoxInfo>& inputs, float nms_threshold, int type)
+void QGDetector::nms(std::vector<BoxInfo>& inputs, std::vector<BoxInfo>& outputs, float nms_threshold, NmsScratch& scratch, int type)
 {
-  std::vector<BoxInfo> outputs;
-  std::sort(inputs.begin(), inputs.end(), [](const BoxInfo& a, const BoxInfo& b) { return a.score > b.score; });
-  int box_num = inputs.size();
-  std::vector<int> merged(box_num, 0);
+  outputs.clear();
+  const QGKernels& kernels = qg_kernels();
+  if (type != nms_type::hard && type != nms_type::blending)
+  {
+    fprintf(stderr, "(!)----Error: Wrong type of nms.");
+    exit(-1);
+  }
+
+  // partition candidates by class, best score first inside a class.
+  std::sort(inputs.begin(), inputs.end(), [](const BoxInfo& a, const BoxInfo& b)
+    {
+      return a.labelid < b.labelid || (a.labelid == b.labelid && a.score > b.score);
+    });
 
-  for (int i = 0; i < box_num; i++)
+  int box_num = inputs.size();
+  for (int begin = 0, end = 0; begin < box_num; begin = end)
   {
-    if (merged[i])
-      continue;
-    std::vector<BoxInfo> outs;
+    end = begin;
+    while (end < box_num && inputs[end].labelid == inputs[begin].labelid)
+      end++;
 
-    outs.push_back(inputs[i]);
-    merged[i] = 1;
+    int num = end - begin;
+    if (params.nms_top_k > 0)
+      num = std::min(num, params.nms_top_k);
+    const BoxInfo* boxes = inputs.data() + begin;
 
-    float area0 = inputs[i].bbox.width * inputs[i].bbox.height;
+    // sweep on x: only candidates whose left edge lies in [x - max_width, x + width] can overlap box x.
+    // the candidates are laid out in x order so that the iou kernel streams through each window.
+    scratch.order.resize(num);
+    scratch.position.resize(num);
+    int max_width = 0;
+    for (int i = 0; i < num; i++)
+    {
+      scratch.order[i] = i;
+      max_width = std::max(max_width, boxes[i].bbox.width);
+    }
+    std::sort(scratch.order.begin(), scratch.order.end(), [boxes](int a, int b) { return boxes[a].bbox.x < boxes[b].bbox.x; });
 
-    for (int j = i + 1; j < box_num; j++)
+    for (auto* buffer : { &scratch.x0, &scratch.y0, &scratch.x1, &scratch.y1, &scratch.area })
+      buffer->resize(num);
+    scratch.merged.assign(num, 0);
+    scratch.over.resize(num);
+    for (int k = 0; k < num; k++)
     {
-      if (merged[j])
-        continue;
+      const cv::Rect& box = boxes[scratch.order[k]].bbox;
+      scratch.position[scratch.order[k]] = k;
+      scratch.x0[k] = box.x;
+      scratch.y0[k] = box.y;
+      scratch.x1[k] = box.br().x;
+      scratch.y1[k] = box.br().y;
+      scratch.area[k] = box.width * box.height;
+    }
 
-      float inner_x0 = std::max(inputs[i].bbox.x, inputs[j].bbox.x);
-      float inner_y0 = std::max(inputs[i].bbox.y, inputs[j].bbox.y);
+    for (int i = 0; i < num; i++)
+    {
+      int p = scratch.position[i];
+      if (scratch.merged[p])
+        continue;
+      scratch.merged[p] = 1;
 
-      float inner_x1 = std::min(inputs[i].bbox.br().x, inputs[j].bbox.br().x);
-      float inner_y1 = std::min(inputs[i].bbox.br().y, inputs[j].bbox.br().y);
+      const cv::Rect& box0 = boxes[i].bbox;
 
-      float inner_w = inner_x1 - inner_x0 + 1;
-      float inner_h = inner_y1 - inner_y0 + 1;
+      // blending accumulators, weighted by exp(score)
+      float weight = exp(boxes[i].score);
+      float total = weight;
+      float x = box0.x * weight, y = box0.y * weight, w = box0.width * weight, h = box0.height * weight;
+      float score = boxes[i].score * weight;
 
-      if (inner_h <= 0 || inner_w <= 0)
-        continue;
+      int first = std::lower_bound(scratch.x0.begin(), scratch.x0.end(), scratch.x0[p] - max_width) - scratch.x0.begin();
+      int last = std::upper_bound(scratch.x0.begin(), scratch.x0.end(), scratch.x1[p]) - scratch.x0.begin();
+      const float box[5] = { scratch.x0[p], scratch.y0[p], scratch.x1[p], scratch.y1[p], scratch.area[p] };
+      kernels.iou_over(&scratch.x0[first], &scratch.y0[first], &scratch.x1[first], &scratch.y1[first], &scratch.area[first],
+        last - first, box, nms_threshold, &scratch.over[first]);
 
-      float inner_area = inner_h * inner_w;
-      float area1 = inputs[j].bbox.width * inputs[j].bbox.height;
-      float score = inner_area / (area0 + area1 - inner_area);
-      if (score > params.nms_threshold)
+      for (int k = first; k < last; k++)
       {
-        merged[j] = 1;
-        outs.push_back(inputs[j]);
+        if (scratch.merged[k] || !scratch.over[k])
+          continue;
+
+        scratch.merged[k] = 1;
+        if (type == nms_type::blending)
+        {
+          const BoxInfo& box1 = boxes[scratch.order[k]];
+          float rate = exp(box1.score);
+          total += rate;
+          x += box1.bbox.x * rate;
+          y += box1.bbox.y * rate;
+          w += box1.bbox.width * rate;
+          h += box1.bbox.height * rate;
+          score += box1.score * rate;
+        }
       }
-    }
-    switch (type)
-    {
-    case nms_type::hard:
-    {
-      outputs.push_back(outs[0]);
-      break;
-    }
-    case nms_type::blending:
-    {
-      float total = 0;
-      for (int i = 0; i < outs.size(); i++)
+
+      if (type == nms_type::hard)
       {
-        total += exp(outs[i].score);
+        outputs.push_back(boxes[i]);
       }
-      BoxInfo out;
-      memset(&out, 0, sizeof(out));
-      for (int i = 0; i < outs.size(); i++)
+      else
       {
-        float rate = exp(outs[i].score) / total;
-        out.bbox.x += outs[i].bbox.x * rate;
-        out.bbox.y += outs[i].bbox.y * rate;
-        out.bbox.width += outs[i].bbox.width * rate;
-        out.bbox.height += outs[i].bbox.height * rate;
-        out.score += outs[i].score * rate;
+        BoxInfo out;
+        out.bbox = cv::Rect(x / total, y / total, w / total, h / total);
+        out.labelid = boxes[i].labelid;
+        out.score = score / total;
+        outputs.push_back(out);
       }
-      outputs.push_back(out);
-      break;
-    }
-    default:
-    {
-      fprintf(stderr, "(!)----Error: Wrong type of nms.");
-      exit(-1);
-    }
     }
   }
 
-  return outputs;
+  std::sort(outputs.begin(), outputs.end(), [](const BoxInfo& a, const BoxInfo& b) { return a.score > b.score; });
+  if (params.max_detections > 0 && (int)outputs.size() > params.max_detections)
+    outputs.resize(params.max_detections);
 }
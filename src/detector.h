@@ -26,11 +26,41 @@ public:
     int num_classes = 80;
 
     int num_thread = 2;
+    MNNForwardType forward_type = MNN_FORWARD_CPU;
+    MNN::BackendConfig::PrecisionMode precision = MNN::BackendConfig::Precision_Low;
+    MNN::BackendConfig::PowerMode power = MNN::BackendConfig::Power_Normal;
+    MNN::BackendConfig::MemoryMode memory = MNN::BackendConfig::Memory_Normal;
     float score_threshold = 0.3;
     float nms_threshold = 0.7;
+    int nms_top_k = 300;     /* candidates kept per class before nms, 0 keeps all */
+    int max_detections = 0;  /* boxes kept per frame after nms, 0 keeps all */
+
+    // tiled inference for high resolution frames, disabled when tile_size is 0
+    int tile_size = 0;
+    int tile_overlap = 64;
+    int tile_threads = 1;
+    float tile_merge_threshold = 0.6;  /* intersection over the smaller box, merges halves cut by a seam */
+
+    int num_buffers = 1;  /* input buffers for pipelining prepare() and run() */
+
+    // coarse-to-fine detection, square input sizes tried before width x height, multiples of the largest stride
+    std::vector<int> coarse_sizes;
+
+    int warmup_runs = 3;  /* inferences on noise per session at init, after the first one, before the detector is ready */
     Params() {}
   } Params;
 
+  // tiled detection figures, summed over frames, reported by the caller
+  typedef struct TileStats
+  {
+    int frames = 0;
+    int tiles = 0;
+    int workers = 0;        /* contexts the tiles of a frame are spread over */
+    double tile_ms = 0;
+    double max_tile_ms = 0;
+    double elapsed_ms = 0;  /* frames from the first tile to merged boxes */
+  } TileStats;
+
 protected:
   enum nms_type
   {
@@ -48,23 +78,94 @@ protected:
     std::vector<Anchor> anchors;
   } Yolov5LayerData;
 
+  typedef struct NmsScratch
+  {
+    std::vector<int> order;     /* x order position to score rank, for the candidates of one class */
+    std::vector<int> position;  /* score rank to x order position */
+    std::vector<float> x0, y0, x1, y1, area;  /* boxes in x order */
+    std::vector<unsigned char> merged, over;  /* by x order position */
+  } NmsScratch;
+
+  typedef struct Context
+  {
+    MNN::Session* session = nullptr;
+    MNN::Tensor* input_tensor = nullptr;
+    std::shared_ptr<MNN::CV::ImageProcess> pretreat = nullptr;
+    NmsScratch nms_scratch;
+
+    // per call buffers, allocated at init and reused across frames
+    cv::Size input_size;
+    cv::Mat resized;
+    cv::Size frame_size;
+    std::vector<MNN::Tensor*> outputs;
+    std::vector<std::shared_ptr<MNN::Tensor>> hosts;
+    std::vector<const MNN::Tensor*> reads;  /* output itself when readable in place, its host copy otherwise */
+    std::vector<BoxInfo> candidates;
+    std::vector<float> confidences;  /* objectness of one row of cells */
+    std::shared_ptr<MNN::Tensor> input_host = nullptr;  /* planar input copy, created on first use */
+    double first_ms = 0;  /* first inference of the session, at init */
+  } Context;
+
 public:
   ~QGDetector();
   int init(std::string model_path, const Params& params = Params());
+  // sessions of their own on the model and runtime of an initialized detector, without loading the model again.
+  int init(const QGDetector& shared);
   std::vector<BoxInfo> detect(const cv::Mat& frame);
+  void detect(const cv::Mat& frame, std::vector<BoxInfo>& outputs);
+
+  // coarse-to-fine use: level 0 is the coarsest input size, levels() - 1 the full width x height one.
+  // coarse levels run untiled on their own session.
+  int levels() const { return (int)coarse.size() + 1; }
+  cv::Size input_size(int level) const;
+  void detect(const cv::Mat& frame, std::vector<BoxInfo>& outputs, int level);
+
+  // preprocessed input use, at the full width x height level and untiled: export_input() writes what
+  // preprocessing feeds the network, the resized bgr image or the planar float tensor, input_bytes() long.
+  size_t input_bytes(bool planar) const;
+  void export_input(const cv::Mat& frame, bool planar, void* data);
+  void detect_input(const void* data, bool planar, const cv::Size& frame_size, std::vector<BoxInfo>& outputs);
+
+  // pipelined use: prepare() the next frame into one buffer while run() infers another one.
+  // each buffer owns its session, calls on different buffers may overlap, not on the same one.
+  int buffers() const { return params.num_buffers; }
+  bool prepare(const cv::Mat& frame, int buffer);
+  void run(int buffer, std::vector<BoxInfo>& outputs);
+
+  // tiled use: figures since the last reset, the instances of a pool are summed with add_tiles().
+  const TileStats& tile_stats() const { return tile_counts; }
+  void reset_tile_stats() { tile_counts = TileStats(); }
+  static void add_tiles(TileStats& total, const TileStats& stats);
+  static void report_tiles(const TileStats& stats);
 
 protected:
-  std::vector<BoxInfo> decode(MNN::Tensor& data, int stride, std::vector<Yolov5LayerData::Anchor> anchors, int width, int height);
-  std::vector<BoxInfo> nms(std::vector<BoxInfo>& inputs, float nms_threshold, int type = nms_type::hard);
+  int init_sessions(bool check);
+  int init_context(Context& context, const cv::Size& input_size, const MNN::ScheduleConfig& config, const MNN::RuntimeInfo& runtime);
+  // runs warmup_runs inferences on every session and logs first and steady state latencies by input size.
+  void warm_up(const std::string& model_path);
+  void infer(Context& context, const cv::Mat& frame, std::vector<BoxInfo>& boxes);
+  void preprocess(Context& context, const cv::Mat& frame);
+  void forward(Context& context, std::vector<BoxInfo>& boxes);
+  void detect_tiled(const cv::Mat& frame, std::vector<BoxInfo>& outputs);
+  std::vector<cv::Rect> make_tiles(const cv::Size& size) const;
+  std::vector<BoxInfo> merge_seams(std::vector<BoxInfo>& inputs, const std::vector<cv::Rect>& tiles, const cv::Size& frame_size, float merge_threshold);
+  void decode(const MNN::Tensor& data, int stride, const std::vector<Yolov5LayerData::Anchor>& anchors, const cv::Size& input_size, const cv::Size& frame_size, float* confidences, std::vector<BoxInfo>& outputs);
+  void nms(std::vector<BoxInfo>& inputs, std::vector<BoxInfo>& outputs, float nms_threshold, NmsScratch& scratch, int type = nms_type::hard);
 
 private:
   std::shared_ptr<MNN::Interpreter> interpreter = nullptr;
-  std::shared_ptr<MNN::CV::ImageProcess> pretreat = nullptr;
-  MNN::Session* session = nullptr;
-  MNN::Tensor* input_tensor = nullptr;
+  std::string model_path;
+  MNN::ScheduleConfig schedule_config;
+  MNN::BackendConfig backend_config;
+  MNN::RuntimeInfo runtime;
+  std::vector<Context> contexts;
+  std::vector<Context> coarse;  /* one per coarse size, coarsest first */
 
   bool initialized = false;
   Params params;
+  TileStats tile_counts;
+
+  friend class QGBenchmark;
 
   const float norm_vals[3] = { 1.0 / 255, 1.0 / 255, 1.0 / 255 };
   std::vector <Yolov5LayerData> layers =
@@ -0,0 +1,276 @@
+#include "evaluator.h"
+
+#include <fstream>
+
+static const char* FOREIGN_MATTER = "FOREIGN MATTER";
+
+QGEvaluator::QGEvaluator(const std::vector<std::string>& detect_labels, const std::vector<std::string>& classify_labels)
+  : detect_labels(detect_labels), classify_labels(classify_labels)
+{
+  for (size_t i = 0; i < detect_labels.size(); i++)
+    if (detect_labels[i] == FOREIGN_MATTER)
+      foreign_detect = (int)i;
+  for (size_t i = 0; i < classify_labels.size(); i++)
+    if (classify_labels[i] == FOREIGN_MATTER)
+      foreign_classify = (int)i;
+}
+
+int QGEvaluator::init(const Params& params)
+{
+  this->params = params;
+  int classes = (int)classify_labels.size() + 1;
+  confusion.assign(classes, std::vector<int>(classes, 0));
+  labels.clear();
+  if (params.truth != "lots" && !load_csv(params.truth))
+    return 0;
+  return 1;
+}
+
+bool QGEvaluator::parse_label(const std::string& text, int& label) const
+{
+  if (text == "NONE")
+  {
+    label = (int)classify_labels.size();
+    return true;
+  }
+  for (size_t i = 0; i < classify_labels.size(); i++)
+  {
+    if (classify_labels[i] == text)
+    {
+      label = (int)i;
+      return true;
+    }
+  }
+  char* end = nullptr;
+  long index = strtol(text.c_str(), &end, 10);
+  if (text.empty() || *end != '\0' || index < 0 || index >= (long)classify_labels.size())
+    return false;
+  label = (int)index;
+  return true;
+}
+
+bool QGEvaluator::load_csv(const std::string& path)
+{
+  std::ifstream file(path);
+  if (!file.is_open())
+  {
+    fprintf(stderr, "(!)----Error: cannot open ground truth %s.\n", path.c_str());
+    return false;
+  }
+
+  std::string line;
+  for (int number = 1; std::getline(file, line); number++)
+  {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.empty())
+      continue;
+
+    std::vector<std::string> fields;
+    size_t start = 0;
+    for (size_t comma; (comma = line.find(',', start)) != std::string::npos; start = comma + 1)
+      fields.push_back(line.substr(start, comma - start));
+    fields.push_back(line.substr(start));
+    for (auto& field : fields)
+    {
+      if (field.size() >= 2 && field.front() == '"' && field.back() == '"')
+        field = field.substr(1, field.size() - 2);
+    }
+
+    int label = 0;
+    if ((fields.size() != 2 && fields.size() != 3) || !parse_label(fields.back(), label))
+    {
+      // a header line is allowed
+      if (number == 1)
+        continue;
+      fprintf(stderr, "(!)----Error: invalid ground truth line %d in %s.\n", number, path.c_str());
+      return false;
+    }
+    labels[fields.size() == 3 ? fields[0] + "/" + fields[1] : fields[0]] = label;
+  }
+  printf("(i)----ground truth %s: %d pairs\n", path.c_str(), (int)labels.size());
+  return true;
+}
+
+bool QGEvaluator::truth(const std::string& lot, const std::string& name, int& label) const
+{
+  if (params.truth == "lots")
+    return parse_label(lot, label);
+
+  auto found = labels.find(lot + "/" + name);
+  if (found == labels.end())
+    found = labels.find(name);
+  if (found == labels.end())
+    return false;
+  label = found->second;
+  return true;
+}
+
+void QGEvaluator::add(const std::string& lot, const std::string& name, const GradeInfo& info, const QGResults::Timings& timings, bool cached)
+{
+  int none = (int)classify_labels.size();
+  int expected = 0;
+  bool labelled = truth(lot, name, expected);
+  int predicted = info.cinfos.empty() ? none : info.cinfos[0].labelid;
+  bool boxes = !info.udinfos.empty() || !info.ddinfos.empty();
+  bool foreign_box = false;
+  for (const auto* view : { &info.udinfos, &info.ddinfos })
+    for (const auto& box : *view)
+      foreign_box = foreign_box || box.labelid == foreign_detect;
+
+  std::lock_guard<std::mutex> guard(lock);
+  graded++;
+  if (cached)
+    this->cached++;
+  else
+  {
+    sum.decode_ms += timings.decode_ms;
+    sum.detect_ms += timings.detect_ms;
+    sum.classify_ms += timings.classify_ms;
+    sum.total_ms += timings.total_ms;
+  }
+  if (!labelled)
+    return;
+  confusion[expected][predicted]++;
+  if (expected == foreign_classify)
+  {
+    foreign++;
+    detected += foreign_box ? 1 : 0;
+  }
+  else if (foreign_box)
+    false_alarms++;
+  if (expected != none)
+  {
+    occupied++;
+    occupied_boxes += boxes ? 1 : 0;
+  }
+  else if (boxes)
+    empty_boxes++;
+}
+
+int QGEvaluator::report(int workers, int failed, int unlabelled, double elapsed_ms) const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  int classes = (int)confusion.size();
+  int none = classes - 1;
+  auto label_name = [&](int label) { return label == none ? std::string("NONE") : classify_labels[label]; };
+
+  std::vector<int> support(classes, 0), predicted(classes, 0);
+  int labelled = 0, correct = 0;
+  for (int t = 0; t < classes; t++)
+  {
+    for (int p = 0; p < classes; p++)
+    {
+      support[t] += confusion[t][p];
+      predicted[p] += confusion[t][p];
+    }
+    labelled += support[t];
+    correct += confusion[t][t];
+  }
+  double accuracy = labelled ? (double)correct / labelled : 0.0;
+  // foreign matter boxes against the foreign matter label, the pairs of every other label are negatives
+  int others = labelled - foreign;
+  double detector_recall = foreign ? (double)detected / foreign : 0.0;
+  double false_alarm_rate = others ? (double)false_alarms / others : 0.0;
+  // cache hits take no inference, throughput is that of the pairs actually graded
+  int timed = graded - cached;
+  double pairs_per_s = elapsed_ms > 0 ? 1000.0 * timed / elapsed_ms : 0.0;
+  auto mean = [&](double total) { return timed ? total / timed : 0.0; };
+
+  // classes without support and without predictions are left out of the per class figures
+  std::vector<int> shown;
+  for (int c = 0; c < classes; c++)
+  {
+    if (support[c] || predicted[c])
+      shown.push_back(c);
+  }
+  double macro_precision = 0, macro_recall = 0;
+  for (int c : shown)
+  {
+    macro_precision += predicted[c] ? (double)confusion[c][c] / predicted[c] : 0.0;
+    macro_recall += support[c] ? (double)confusion[c][c] / support[c] : 0.0;
+  }
+  if (!shown.empty())
+  {
+    macro_precision /= shown.size();
+    macro_recall /= shown.size();
+  }
+
+  printf("    >>> evaluation: %d pairs graded, %d labelled, %d without ground truth, %d failed\n", graded, labelled, unlabelled, failed);
+  printf("    >>> accuracy: %.4f, macro precision: %.4f, macro recall: %.4f\n", accuracy, macro_precision, macro_recall);
+  printf("    >>> foreign matter detection: recall %.4f (%d of %d foreign matter pairs with a foreign matter box), false alarms %.4f (%d of %d other pairs)\n",
+    detector_recall, detected, foreign, false_alarm_rate, false_alarms, others);
+  printf("    >>> any box: %d of %d non-empty pairs, %d of %d empty pairs\n", occupied_boxes, occupied, empty_boxes, support[none]);
+  printf("    >>> confusion, truth by row, prediction by column:\n%16s", "");
+  for (int p : shown)
+    printf(" %8.8s", label_name(p).c_str());
+  printf("\n");
+  for (int t : shown)
+  {
+    printf("%16.16s", label_name(t).c_str());
+    for (int p : shown)
+      printf(" %8d", confusion[t][p]);
+    printf("\n");
+  }
+  for (int c : shown)
+  {
+    printf("    >>> %s: support %d, precision %.4f, recall %.4f\n", label_name(c).c_str(), support[c],
+      predicted[c] ? (double)confusion[c][c] / predicted[c] : 0.0, support[c] ? (double)confusion[c][c] / support[c] : 0.0);
+  }
+  printf("    >>> throughput: %.1f pairs/s on %d workers, %d cache hits left out, mean decode: %f ms, detect: %f ms, classify: %f ms, total: %f ms\n",
+    pairs_per_s, workers, cached, mean(sum.decode_ms), mean(sum.detect_ms), mean(sum.classify_ms), mean(sum.total_ms));
+
+  if (params.report.empty())
+    return 0;
+
+  std::string json = "{\n  \"models\": {\"detector\": ";
+  QGResults::append_escaped(json, params.detector_path, true);
+  json += ", \"classifier\": ";
+  QGResults::append_escaped(json, params.classifier_path, true);
+  json += "},\n  \"ground_truth\": ";
+  QGResults::append_escaped(json, params.truth, true);
+  json += cv::format(",\n  \"pairs\": {\"graded\": %d, \"labelled\": %d, \"unlabelled\": %d, \"failed\": %d},\n", graded, labelled, unlabelled, failed);
+  json += cv::format("  \"accuracy\": %.6f,\n  \"macro_precision\": %.6f,\n  \"macro_recall\": %.6f,\n", accuracy, macro_precision, macro_recall);
+  json += cv::format("  \"detector\": {\"foreign_matter_recall\": %.6f, \"foreign_matter_detected\": %d, \"foreign_matter_pairs\": %d, "
+    "\"false_alarm_rate\": %.6f, \"false_alarms\": %d, \"other_pairs\": %d, "
+    "\"non_empty_with_boxes\": %d, \"non_empty_pairs\": %d, \"empty_with_boxes\": %d, \"empty_pairs\": %d},\n",
+    detector_recall, detected, foreign, false_alarm_rate, false_alarms, others, occupied_boxes, occupied, empty_boxes, support[none]);
+  json += "  \"labels\": [";
+  for (int c = 0; c < classes; c++)
+  {
+    json += c ? ", " : "";
+    QGResults::append_escaped(json, label_name(c), true);
+  }
+  json += "],\n  \"confusion\": [";
+  for (int t = 0; t < classes; t++)
+  {
+    json += t ? ",\n    [" : "\n    [";
+    for (int p = 0; p < classes; p++)
+      json += cv::format(p ? ", %d" : "%d", confusion[t][p]);
+    json += "]";
+  }
+  json += "\n  ],\n  \"classes\": [";
+  for (size_t i = 0; i < shown.size(); i++)
+  {
+    int c = shown[i];
+    json += i ? ",\n    {\"label\": " : "\n    {\"label\": ";
+    QGResults::append_escaped(json, label_name(c), true);
+    json += cv::format(", \"support\": %d, \"predicted\": %d, \"precision\": %.6f, \"recall\": %.6f}", support[c], predicted[c],
+      predicted[c] ? (double)confusion[c][c] / predicted[c] : 0.0, support[c] ? (double)confusion[c][c] / support[c] : 0.0);
+  }
+  json += "\n  ],\n";
+  json += cv::format("  \"throughput\": {\"workers\": %d, \"cached\": %d, \"elapsed_ms\": %.3f, \"pairs_per_s\": %.3f, \"decode_ms\": %.3f, \"detect_ms\": %.3f, \"classify_ms\": %.3f, \"total_ms\": %.3f}\n}\n",
+    workers, cached, elapsed_ms, pairs_per_s, mean(sum.decode_ms), mean(sum.detect_ms), mean(sum.classify_ms), mean(sum.total_ms));
+
+  FILE* file = fopen(params.report.c_str(), "w");
+  if (!file || fwrite(json.data(), 1, json.size(), file) != json.size())
+  {
+    fprintf(stderr, "(!)----Error: cannot write report %s.\n", params.report.c_str());
+    if (file)
+      fclose(file);
+    return -1;
+  }
+  fclose(file);
+  printf("(i)----evaluation report: %s\n", params.report.c_str());
+  return 0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "grader.h"
+#include "results.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+// Scores graded pairs against ground truth: the lot directories named after classify labels,
+// or a label CSV of lot,name,label or name,label lines. Labels are names or indices, NONE
+// marks an empty pair. The report holds the confusion matrix, per class precision and recall,
+// the recall of foreign matter boxes on foreign matter pairs, how many non-empty and empty pairs
+// got any box, and throughput, on stdout and as JSON.
+class QGEvaluator
+{
+public:
+  typedef struct Params
+  {
+    std::string truth = "lots";  /* lots or a label CSV */
+    std::string report;          /* JSON report file */
+    std::string detector_path;
+    std::string classifier_path;
+    Params() {}
+  } Params;
+
+public:
+  QGEvaluator(const std::vector<std::string>& detect_labels, const std::vector<std::string>& classify_labels);
+  int init(const Params& params);
+
+  // label of a pair, classify_labels.size() for NONE, false when the pair has no ground truth.
+  bool truth(const std::string& lot, const std::string& name, int& label) const;
+  // may be called from several threads, pairs without ground truth only count towards throughput,
+  // result cache hits are scored but left out of it.
+  void add(const std::string& lot, const std::string& name, const GradeInfo& info, const QGResults::Timings& timings, bool cached);
+  // figures of the whole run, unlabelled pairs were left out of it.
+  int report(int workers, int failed, int unlabelled, double elapsed_ms) const;
+
+protected:
+  bool parse_label(const std::string& text, int& label) const;
+  bool load_csv(const std::string& path);
+
+private:
+  const std::vector<std::string>& detect_labels;
+  const std::vector<std::string>& classify_labels;
+  int foreign_detect = -1;    /* FOREIGN MATTER among the detect labels, -1 without */
+  int foreign_classify = -1;  /* and among the classify labels */
+  Params params;
+  std::map<std::string, int> labels;  /* by lot/name, or by name */
+
+  std::vector<std::vector<int>> confusion;  /* truth by prediction, NONE last */
+  int graded = 0;
+  int cached = 0;         /* graded pairs served by the result cache */
+  int foreign = 0;        /* pairs labelled foreign matter */
+  int detected = 0;       /* of them, pairs with a foreign matter box */
+  int false_alarms = 0;   /* pairs of any other label with a foreign matter box */
+  int occupied = 0;       /* pairs labelled other than NONE */
+  int occupied_boxes = 0; /* of them, pairs with any box */
+  int empty_boxes = 0;    /* NONE pairs with any box */
+  QGResults::Timings sum;
+  mutable std::mutex lock;
+};
@@ -0,0 +1,316 @@
+#include "grader.h"
+#include "timer.hpp"
+
+#include <chrono>
+
+float UD_SCALE = 1.064f;
+int UD_TRANS[2] = { 48, 18 };
+
+cv::Rect unionbox(const std::vector<BoxInfo>& infos)
+{
+  int x = infos[0].bbox.x, y = infos[0].bbox.y, w = infos[0].bbox.width, h = infos[0].bbox.height;
+  for (const auto& info : infos)
+  {
+    x = std::min(x, info.bbox.x);
+    y = std::min(y, info.bbox.y);
+    w = std::max(w, info.bbox.width);
+    h = std::max(h, info.bbox.height);
+  }
+
+  return cv::Rect(x, y, w, h);
+}
+
+QGGrader::QGGrader(QGDetector& detector, QGClassifier& classifier, const Params& params)
+  : detector(&detector), classifier(&classifier), params(params)
+{
+  counts.runs.resize(detector.levels(), 0);
+  counts.resolved.resize(detector.levels(), 0);
+  counts.detect_ms.resize(detector.levels(), 0.0);
+}
+
+void QGGrader::bind(QGDetector& detector, QGClassifier& classifier)
+{
+  this->detector = &detector;
+  this->classifier = &classifier;
+}
+
+bool QGGrader::parse_rule(const std::string& text, SkipRule& rule)
+{
+  return sscanf(text.c_str(), "%d:%f:%d", &rule.detect_label, &rule.min_score, &rule.classify_label) == 3;
+}
+
+void QGGrader::align(cv::Mat& imgU, cv::Mat& imgD, float scale)
+{
+  cv::resize(imgD, imgD, cv::Size(), UD_SCALE, UD_SCALE);
+  imgU = imgU(cv::Rect(0, 0, imgU.cols / 2, imgU.rows));
+  imgD = imgD(cv::Rect(cvRound(UD_TRANS[0] * scale), cvRound(UD_TRANS[1] * scale), imgU.cols, imgU.rows));
+}
+
+void QGGrader::regions(const cv::Size& sizeU, const cv::Size& sizeD, cv::Rect& regionU, cv::Rect& regionD)
+{
+  // align() scales D by UD_SCALE then takes the U sized rectangle at UD_TRANS
+  regionU = cv::Rect(0, 0, sizeU.width / 2, sizeU.height);
+  int x0 = (int)floor(UD_TRANS[0] / UD_SCALE), y0 = (int)floor(UD_TRANS[1] / UD_SCALE);
+  int x1 = (int)ceil((UD_TRANS[0] + regionU.width) / UD_SCALE), y1 = (int)ceil((UD_TRANS[1] + regionU.height) / UD_SCALE);
+  regionD = cv::Rect(x0, y0, x1 - x0, y1 - y0) & cv::Rect(0, 0, sizeD.width, sizeD.height);
+}
+
+void QGGrader::align_regions(cv::Mat& imgU, cv::Mat& imgD)
+{
+  cv::resize(imgD, imgD, imgU.size());
+}
+
+void QGGrader::rescale(GradeInfo& info, float factor)
+{
+  auto scale = [factor](cv::Rect& rect)
+  {
+    rect = cv::Rect(cvRound(rect.x * factor), cvRound(rect.y * factor), cvRound(rect.width * factor), cvRound(rect.height * factor));
+  };
+  for (auto* dinfos : { &info.udinfos, &info.ddinfos })
+    for (auto& dinfo : *dinfos)
+      scale(dinfo.bbox);
+  scale(info.ubox);
+  scale(info.dbox);
+}
+
+void QGGrader::detect(const cv::Mat& imgU, const cv::Mat& imgD, GradeInfo& info)
+{
+  Timer::GetInstance().tic();
+  info.detect_ms = 0;
+  int levels = detector->levels();
+  for (int level = 0; level < levels; level++)
+  {
+    auto start = std::chrono::high_resolution_clock::now();
+    detector->detect(imgU, info.udinfos, level);
+    detector->detect(imgD, info.ddinfos, level);
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    counts.detect_ms[level] += elapsed;
+    info.detect_ms += elapsed;
+    counts.runs[level]++;
+    if (level == levels - 1 || !ambiguous(info))
+    {
+      counts.resolved[level]++;
+      break;
+    }
+  }
+  Timer::GetInstance().toc("    >>> detection: ");
+  reconcile(info);
+}
+
+bool QGGrader::ambiguous(const GradeInfo& info) const
+{
+  // an empty tray is only trusted at full resolution
+  if (info.udinfos.empty() || info.ddinfos.empty() || info.udinfos.size() != info.ddinfos.size())
+    return true;
+  for (const auto* dinfos : { &info.udinfos, &info.ddinfos })
+  {
+    float best = 0;
+    for (const auto& dinfo : *dinfos)
+      best = std::max(best, dinfo.score);
+    if (best < params.escalate_score)
+      return true;
+  }
+  return false;
+}
+
+void QGGrader::reconcile(GradeInfo& info)
+{
+  if (info.udinfos.size() != info.ddinfos.size())
+  {
+    if (info.udinfos.size() > 0)
+      info.ddinfos = info.udinfos;
+    else
+      info.udinfos = info.ddinfos;
+  }
+}
+
+bool QGGrader::compose(const cv::Mat& imgU, const cv::Mat& imgD, GradeInfo& info)
+{
+  if (info.udinfos.empty() || info.ddinfos.empty())
+    return false;
+
+  int w = imgU.cols * 2, h = imgU.rows;
+  info.infer.create(h, w, imgU.type());
+  info.infer = cv::Scalar(0, 0, 0);
+
+  // each view is centered in its half of the composition
+  auto place = [&](const cv::Mat& view, const cv::Rect& box, int center_x)
+  {
+    cv::Rect dst(center_x - box.width / 2, h / 2 - box.height / 2, box.width, box.height);
+    cv::Rect clipped = dst & cv::Rect(0, 0, w, h);
+    cv::Rect src(box.x + clipped.x - dst.x, box.y + clipped.y - dst.y, clipped.width, clipped.height);
+    if (!clipped.empty())
+      view(src).copyTo(info.infer(clipped));
+  };
+
+  info.ubox = unionbox(info.udinfos) & cv::Rect(0, 0, imgU.cols, imgU.rows);
+  info.dbox = unionbox(info.ddinfos) & cv::Rect(0, 0, imgD.cols, imgD.rows);
+  place(imgU, info.ubox, w / 4);
+  place(imgD, info.dbox, w / 2 + w / 4);
+  return true;
+}
+
+const QGGrader::SkipRule* QGGrader::match(const GradeInfo& info, float& score) const
+{
+  for (const auto& rule : params.skip_rules)
+  {
+    for (const auto* dinfos : { &info.udinfos, &info.ddinfos })
+    {
+      for (const auto& dinfo : *dinfos)
+      {
+        if (dinfo.labelid == rule.detect_label && dinfo.score >= rule.min_score)
+        {
+          score = dinfo.score;
+          return &rule;
+        }
+      }
+    }
+  }
+  return nullptr;
+}
+
+void QGGrader::grade(const cv::Mat& imgU, const cv::Mat& imgD, GradeInfo& info)
+{
+  detect(imgU, imgD, info);
+  const SkipRule* rule = nullptr;
+  if (!settle(info, imgU.size(), imgD.size(), rule) || !compose(imgU, imgD, info))
+    return;
+  classify(info, rule, nullptr, false);
+}
+
+bool QGGrader::grade_inputs(const void* inputU, const void* inputD, const cv::Size& sizeU, const cv::Size& sizeD,
+  const void* inputC, bool planar, GradeInfo& info)
+{
+  Timer::GetInstance().tic();
+  auto start = std::chrono::high_resolution_clock::now();
+  detector->detect_input(inputU, planar, sizeU, info.udinfos);
+  detector->detect_input(inputD, planar, sizeD, info.ddinfos);
+  info.detect_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+  Timer::GetInstance().toc("    >>> detection: ");
+  reconcile(info);
+
+  // nothing is counted before it is known that the inputs are enough
+  float score = 0;
+  const SkipRule* rule = match(info, score);
+  bool empty = info.udinfos.empty() && info.ddinfos.empty();
+  if (!empty && (!rule || params.skip_dry_run) && !inputC)
+    return false;
+
+  int level = detector->levels() - 1;
+  counts.runs[level]++;
+  counts.resolved[level]++;
+  counts.detect_ms[level] += info.detect_ms;
+  if (!settle(info, sizeU, sizeD, rule))
+    return true;
+  info.ubox = unionbox(info.udinfos) & cv::Rect(0, 0, sizeU.width, sizeU.height);
+  info.dbox = unionbox(info.ddinfos) & cv::Rect(0, 0, sizeD.width, sizeD.height);
+  classify(info, rule, inputC, planar);
+  return true;
+}
+
+bool QGGrader::settle(GradeInfo& info, const cv::Size& sizeU, const cv::Size& sizeD, const SkipRule*& rule)
+{
+  counts.pairs++;
+  rule = nullptr;
+  info.cinfos.clear();
+  info.skipped = false;
+  info.classify_ms = 0;
+  if (info.udinfos.empty() && info.ddinfos.empty())
+  {
+    counts.empty++;
+    return false;
+  }
+
+  float score = 0;
+  rule = match(info, score);
+  if (rule && !params.skip_dry_run)
+  {
+    counts.skipped++;
+    info.skipped = true;
+    info.ubox = unionbox(info.udinfos) & cv::Rect(0, 0, sizeU.width, sizeU.height);
+    info.dbox = unionbox(info.ddinfos) & cv::Rect(0, 0, sizeD.width, sizeD.height);
+    info.cinfos.push_back({ rule->classify_label, score });
+    return false;
+  }
+  return true;
+}
+
+void QGGrader::classify(GradeInfo& info, const SkipRule* rule, const void* input, bool planar)
+{
+  Timer::GetInstance().tic();
+  auto start = std::chrono::high_resolution_clock::now();
+  if (input)
+    classifier->classify_input(input, planar, info.cinfos);
+  else
+    classifier->classify(info.infer, info.cinfos);
+  info.classify_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+  Timer::GetInstance().toc("    >>> classify: ");
+
+  if (rule)
+  {
+    counts.checked++;
+    counts.disagreed += info.cinfos[0].labelid != rule->classify_label ? 1 : 0;
+  }
+}
+
+void QGGrader::add(const Stats& stats)
+{
+  counts.pairs += stats.pairs;
+  counts.empty += stats.empty;
+  counts.skipped += stats.skipped;
+  counts.checked += stats.checked;
+  counts.disagreed += stats.disagreed;
+  for (size_t level = 0; level < counts.runs.size() && level < stats.runs.size(); level++)
+  {
+    counts.runs[level] += stats.runs[level];
+    counts.resolved[level] += stats.resolved[level];
+    counts.detect_ms[level] += stats.detect_ms[level];
+  }
+}
+
+void QGGrader::reset()
+{
+  size_t levels = counts.runs.size();
+  counts = Stats();
+  counts.runs.resize(levels, 0);
+  counts.resolved.resize(levels, 0);
+  counts.detect_ms.resize(levels, 0.0);
+}
+
+void QGGrader::report() const
+{
+  int levels = detector->levels();
+  if (levels > 1 && counts.pairs > 0)
+  {
+    double spent = 0;
+    for (int level = 0; level < levels; level++)
+    {
+      cv::Size size = detector->input_size(level);
+      printf("    >>> level %dx%d: %d pairs detected, %d resolved (%.1f%%), mean: %f ms\n", size.width, size.height,
+        counts.runs[level], counts.resolved[level], 100.0 * counts.resolved[level] / counts.pairs,
+        counts.runs[level] ? counts.detect_ms[level] / counts.runs[level] : 0.0);
+      spent += counts.detect_ms[level];
+    }
+    int escalated = counts.runs[levels - 1];
+    printf("    >>> coarse-to-fine: %d of %d pairs escalated to full resolution (%.1f%%)\n",
+      escalated, counts.pairs, 100.0 * escalated / counts.pairs);
+    // the full resolution mean stands for what every pair would have cost without the coarse levels
+    if (escalated > 0)
+    {
+      double full = counts.pairs * counts.detect_ms[levels - 1] / escalated;
+      printf("    >>> coarse-to-fine: detection %f ms, %f ms at full resolution only, saved %f ms (%.1f%%)\n",
+        spent, full, full - spent, 100.0 * (full - spent) / full);
+    }
+  }
+
+  if (params.skip_rules.empty())
+    return;
+
+  int classified = counts.pairs - counts.empty - counts.skipped;
+  printf("    >>> skip rules: %d pairs, %d without beans, %d skipped (%.1f%%), %d classified\n",
+    counts.pairs, counts.empty, counts.skipped, counts.pairs ? 100.0 * counts.skipped / counts.pairs : 0.0, classified);
+  if (params.skip_dry_run)
+    printf("    >>> skip dry run: rules matched %d pairs (%.1f%%), disagreed with the classifier on %d (%.1f%%)\n",
+      counts.checked, counts.pairs ? 100.0 * counts.checked / counts.pairs : 0.0,
+      counts.disagreed, counts.checked ? 100.0 * counts.disagreed / counts.checked : 0.0);
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "detector.h"
+#include "classifier.h"
+
+#include <opencv2/opencv.hpp>
+
+// rig calibration: D is scaled then translated onto U
+extern float UD_SCALE;
+extern int UD_TRANS[2];
+
+cv::Rect unionbox(const std::vector<BoxInfo>& infos);
+
+typedef struct GradeInfo
+{
+  std::vector<BoxInfo> udinfos;
+  std::vector<BoxInfo> ddinfos;
+  cv::Rect ubox;
+  cv::Rect dbox;
+  std::vector<ClassInfo> cinfos;  /* empty when nothing was detected */
+  bool skipped = false;           /* graded by a skip rule, cinfos holds the rule's label only */
+
+  cv::Mat infer;  /* composed classifier input */
+  double detect_ms = 0;
+  double classify_ms = 0;  /* 0 when not classified */
+} GradeInfo;
+
+class QGGrader
+{
+public:
+  // a confident detection of detect_label settles the grade as classify_label without classifying.
+  typedef struct SkipRule
+  {
+    int detect_label;
+    float min_score;
+    int classify_label;
+  } SkipRule;
+
+  typedef struct Params
+  {
+    std::vector<SkipRule> skip_rules;
+    bool skip_dry_run = false;  /* classify anyway and count how often the rules would disagree */
+    float escalate_score = 0.5;  /* a coarse level whose best box in a view scores lower escalates to the next one */
+    Params() {}
+  } Params;
+
+  typedef struct Stats
+  {
+    int pairs = 0;
+    int empty = 0;    /* nothing detected, nothing to classify */
+    int skipped = 0;  /* settled by a skip rule */
+    int checked = 0;  /* rule matches classified anyway in dry run */
+    int disagreed = 0;
+
+    // coarse-to-fine detection, by detector level
+    std::vector<int> runs;       /* pairs detected at the level */
+    std::vector<int> resolved;   /* pairs whose detection stopped at the level */
+    std::vector<double> detect_ms;
+  } Stats;
+
+public:
+  QGGrader(QGDetector& detector, QGClassifier& classifier, const Params& params = Params());
+  // grades with other instances of the same models from now on, e.g. leased from a pool.
+  void bind(QGDetector& detector, QGClassifier& classifier);
+
+  // crops the used half of U and registers D onto it, scale is the decoded size over the full one.
+  static void align(cv::Mat& imgU, cv::Mat& imgD, float scale = 1.0f);
+  // full resolution regions of U and D that align() keeps, nothing else needs to be decoded.
+  static void regions(const cv::Size& sizeU, const cv::Size& sizeD, cv::Rect& regionU, cv::Rect& regionD);
+  // aligns views decoded from regions() only: D is scaled onto U.
+  static void align_regions(cv::Mat& imgU, cv::Mat& imgD);
+  // multiplies the boxes by factor, e.g. back to full resolution after a reduced decode.
+  static void rescale(GradeInfo& info, float factor);
+
+  // detects on both views, from the coarsest detector level up to the first unambiguous one,
+  // and reconciles the U/D box counts.
+  void detect(const cv::Mat& imgU, const cv::Mat& imgD, GradeInfo& info);
+  // a view that disagrees with the other one on the box count takes its boxes.
+  static void reconcile(GradeInfo& info);
+  // places the union boxes of both views side by side, false when nothing was detected.
+  bool compose(const cv::Mat& imgU, const cv::Mat& imgD, GradeInfo& info);
+  void grade(const cv::Mat& imgU, const cv::Mat& imgD, GradeInfo& info);
+  // grades from preprocessed inputs of both views instead of images, at full resolution only.
+  // inputC is the classifier input of the pair, false when it would be needed but is missing.
+  bool grade_inputs(const void* inputU, const void* inputD, const cv::Size& sizeU, const cv::Size& sizeD,
+    const void* inputC, bool planar, GradeInfo& info);
+
+  // parses "detect_label:min_score:classify_label".
+  static bool parse_rule(const std::string& text, SkipRule& rule);
+  const Stats& stats() const { return counts; }
+  // adds the counts of another grader of the same detector levels, for one report over several workers.
+  void add(const Stats& stats);
+  // clears the counts, e.g. between the passes of the images daemon.
+  void reset();
+  void report() const;
+
+protected:
+  // counts the pair and settles it without the classifier when it can, true when it has to be classified.
+  bool settle(GradeInfo& info, const cv::Size& sizeU, const cv::Size& sizeD, const SkipRule*& rule);
+  void classify(GradeInfo& info, const SkipRule* rule, const void* input, bool planar);
+  bool ambiguous(const GradeInfo& info) const;
+  const SkipRule* match(const GradeInfo& info, float& score) const;
+
+private:
+  QGDetector* detector;
+  QGClassifier* classifier;
+  Params params;
+  Stats counts;
+};
@@ -0,0 +1,43 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+// 64-bit content hash, eight bytes per step with a multiply-xorshift mix.
+// not cryptographic, stable across runs and machines of the same endianness.
+inline uint64_t qg_hash64(const void* data, size_t size, uint64_t seed = 0)
+{
+  const uint64_t m = 0x9E3779B97F4A7C15ull;
+  auto mix = [](uint64_t h)
+  {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+  };
+
+  const unsigned char* bytes = (const unsigned char*)data;
+  uint64_t h = seed ^ (size * m);
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    h = (h ^ mix(word)) * m;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, bytes + i, size - i);
+  h = (h ^ mix(tail)) * m;
+  return mix(h);
+}
+
+inline uint64_t qg_hash64(const std::string& text, uint64_t seed = 0)
+{
+  return qg_hash64(text.data(), text.size(), seed);
+}
+
+#endif //HASH_H
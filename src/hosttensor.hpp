@@ -0,0 +1,29 @@
+#ifndef HOSTTENSOR_H
+#define HOSTTENSOR_H
+
+#include "Tensor.hpp"
+
+#include <memory>
+#include <cstring>
+#include <cassert>
+
+// host copy of a session output in the plain layout the decoders read, NC4HW4 outputs
+// (reported as CAFFE_C4) are copied out as NCHW.
+inline std::shared_ptr<MNN::Tensor> host_tensor(const MNN::Tensor* tensor)
+{
+  MNN::Tensor::DimensionType type = tensor->getDimensionType();
+  return std::make_shared<MNN::Tensor>(tensor, type == MNN::Tensor::CAFFE_C4 ? MNN::Tensor::CAFFE : type);
+}
+
+// An output tensor can be decoded in place when the backend keeps it in host memory with the
+// same layout and element type as its host copy.
+inline bool readable_in_place(const MNN::Tensor* tensor, MNN::Tensor* host)
+{
+  bool same = tensor->host<void>() != nullptr && tensor->getDimensionType() == host->getDimensionType()
+    && tensor->getType() == host->getType() && tensor->elementSize() == host->elementSize() && tensor->size() == host->size();
+  // after a run the two hold the same bytes
+  assert(!same || (tensor->copyToHostTensor(host) && memcmp(tensor->host<void>(), host->host<void>(), host->size()) == 0));
+  return same;
+}
+
+#endif //HOSTTENSOR_H
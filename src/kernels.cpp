@@ -0,0 +1,152 @@
+#include "kernels.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define QG_X86 1
+#define QG_TARGET(isa) __attribute__((target(isa)))
+#else
+#define QG_TARGET(isa)
+#endif
+
+#define QG_INLINE inline __attribute__((always_inline))
+
+// the loops below are written once and instantiated per instruction set, the compiler vectorizes
+// each copy for its target. kernels.cpp is built with -ffp-contract=off so that no variant fuses
+// multiply-adds the others do not.
+
+static QG_INLINE float fast_exp(float x)
+{
+  int32_t i = (int32_t)((1 << 23) * (1.4426950409f * x + 126.93490512f));
+  float f;
+  memcpy(&f, &i, sizeof(f));
+  return f;
+}
+
+static QG_INLINE void sigmoid_strided_impl(const float* src, int stride, int n, float* dst)
+{
+  for (int i = 0; i < n; i++)
+    dst[i] = 1.0f / (1.0f + fast_exp(-src[i * stride]));
+}
+
+static QG_INLINE void iou_over_impl(const float* x0, const float* y0, const float* x1, const float* y1, const float* area,
+  int n, const float box[5], float threshold, unsigned char* over)
+{
+  const float bx0 = box[0], by0 = box[1], bx1 = box[2], by1 = box[3], barea = box[4];
+  for (int i = 0; i < n; i++)
+  {
+    float inner_w = (x1[i] < bx1 ? x1[i] : bx1) - (x0[i] > bx0 ? x0[i] : bx0) + 1;
+    float inner_h = (y1[i] < by1 ? y1[i] : by1) - (y0[i] > by0 ? y0[i] : by0) + 1;
+    float inner_area = inner_w * inner_h;
+    float iou = inner_area / (barea + area[i] - inner_area);
+    over[i] = (inner_w > 0) & (inner_h > 0) & (iou > threshold);
+  }
+}
+
+#define QG_VARIANTS(suffix, isa)                                                                                   \
+  QG_TARGET(isa) static void sigmoid_strided_##suffix(const float* src, int stride, int n, float* dst)              \
+  {                                                                                                                \
+    sigmoid_strided_impl(src, stride, n, dst);                                                                     \
+  }                                                                                                                \
+  QG_TARGET(isa) static void iou_over_##suffix(const float* x0, const float* y0, const float* x1, const float* y1,  \
+    const float* area, int n, const float box[5], float threshold, unsigned char* over)                            \
+  {                                                                                                                \
+    iou_over_impl(x0, y0, x1, y1, area, n, box, threshold, over);                                                  \
+  }
+
+static void sigmoid_strided_generic(const float* src, int stride, int n, float* dst)
+{
+  sigmoid_strided_impl(src, stride, n, dst);
+}
+static void iou_over_generic(const float* x0, const float* y0, const float* x1, const float* y1,
+  const float* area, int n, const float box[5], float threshold, unsigned char* over)
+{
+  iou_over_impl(x0, y0, x1, y1, area, n, box, threshold, over);
+}
+
+#ifdef QG_X86
+QG_VARIANTS(sse4, "sse4.2")
+QG_VARIANTS(avx2, "avx2")
+QG_VARIANTS(avx512, "avx512f,avx512bw,avx512dq,avx512vl")
+#endif
+
+static const QGKernels variants[] =
+{
+#ifdef QG_X86
+  { "avx512", sigmoid_strided_avx512, iou_over_avx512 },
+  { "avx2", sigmoid_strided_avx2, iou_over_avx2 },
+  { "sse4", sigmoid_strided_sse4, iou_over_sse4 },
+  { "generic", sigmoid_strided_generic, iou_over_generic },
+#elif defined(__aarch64__)
+  /* advanced simd is part of the aarch64 baseline, the generic build already uses it */
+  { "asimd", sigmoid_strided_generic, iou_over_generic },
+  { "generic", sigmoid_strided_generic, iou_over_generic },
+#else
+  { "generic", sigmoid_strided_generic, iou_over_generic },
+#endif
+};
+
+static bool supported(const std::string& name)
+{
+#ifdef QG_X86
+  __builtin_cpu_init();
+  if (name == "avx512")
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+      && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl");
+  if (name == "avx2")
+    return __builtin_cpu_supports("avx2");
+  if (name == "sse4")
+    return __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__) && defined(__linux__)
+  if (name == "asimd")
+    return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+#endif
+  return name == "generic";
+}
+
+static const QGKernels* best()
+{
+  for (const auto& variant : variants)
+    if (supported(variant.name))
+      return &variant;
+  return &variants[sizeof(variants) / sizeof(variants[0]) - 1];
+}
+
+static const QGKernels* selected = best();
+
+const QGKernels& qg_kernels()
+{
+  return *selected;
+}
+
+bool qg_select_kernels(const std::string& isa)
+{
+  if (isa == "auto")
+  {
+    selected = best();
+    return true;
+  }
+
+  for (const auto& variant : variants)
+  {
+    if (isa != variant.name)
+      continue;
+    if (!supported(isa))
+    {
+      fprintf(stderr, "(!)----Error: this cpu cannot run the %s kernels, keeping %s.\n", isa.c_str(), selected->name);
+      return false;
+    }
+    selected = &variant;
+    return true;
+  }
+
+  fprintf(stderr, "(!)----Error: unknown kernel variant %s, keeping %s.\n", isa.c_str(), selected->name);
+  return false;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+
+// Hot loops of our own, compiled for several instruction sets and picked once at startup from
+// the cpu features (cpuid on x86, hwcap on aarch64). Every variant gives the same results.
+typedef struct QGKernels
+{
+  const char* name;
+
+  // dst[i] = sigmoid(src[i * stride]) for i in [0, n), with the fast exp approximation of decode.
+  void (*sigmoid_strided)(const float* src, int stride, int n, float* dst);
+
+  // over[i] = IoU of box {x0, y0, x1, y1, area} with candidate i > threshold, using the inclusive
+  // inner extent of nms.
+  void (*iou_over)(const float* x0, const float* y0, const float* x1, const float* y1, const float* area,
+    int n, const float box[5], float threshold, unsigned char* over);
+} QGKernels;
+
+const QGKernels& qg_kernels();
+
+// isa: auto, generic, sse4, avx2, avx512 (x86) or asimd (aarch64).
+// returns false and keeps the current selection when the cpu cannot run the requested variant.
+bool qg_select_kernels(const std::string& isa);
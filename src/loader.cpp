@@ -0,0 +1,173 @@
+#include "loader.h"
+#include "grader.h"
+
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+typedef struct LoaderError
+{
+  jpeg_error_mgr manager;
+  jmp_buf jump;
+} LoaderError;
+
+static void loader_error_exit(j_common_ptr cinfo)
+{
+  longjmp(((LoaderError*)cinfo->err)->jump, 1);
+}
+
+static bool is_jpeg(const std::vector<unsigned char>& bytes)
+{
+  return bytes.size() > 3 && bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF;
+}
+
+bool QGLoader::jpeg_size(const std::vector<unsigned char>& bytes, cv::Size& size)
+{
+  if (!is_jpeg(bytes))
+    return false;
+
+  jpeg_decompress_struct cinfo;
+  LoaderError error;
+  cinfo.err = jpeg_std_error(&error.manager);
+  error.manager.error_exit = loader_error_exit;
+  if (setjmp(error.jump))
+  {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, bytes.data(), bytes.size());
+  jpeg_read_header(&cinfo, TRUE);
+  size = cv::Size(cinfo.image_width, cinfo.image_height);
+  jpeg_destroy_decompress(&cinfo);
+  return true;
+}
+
+int QGLoader::reduction(const cv::Size& region, const cv::Size& need)
+{
+  for (int scale : { 8, 4, 2 })
+    if (region.width / scale >= need.width && region.height / scale >= need.height)
+      return scale;
+  return 1;
+}
+
+bool QGLoader::decode(const std::vector<unsigned char>& bytes, int scale, cv::Mat& image, const cv::Rect& region)
+{
+  if (!is_jpeg(bytes))
+  {
+    if (scale != 1)
+      return false;
+    image = cv::imdecode(bytes, cv::IMREAD_COLOR);
+    if (!region.empty() && !image.empty())
+      image = image(region & cv::Rect(0, 0, image.cols, image.rows));
+    return !image.empty();
+  }
+
+  jpeg_decompress_struct cinfo;
+  LoaderError error;
+  cinfo.err = jpeg_std_error(&error.manager);
+  error.manager.error_exit = loader_error_exit;
+  if (setjmp(error.jump))
+  {
+    jpeg_destroy_decompress(&cinfo);
+    image.release();
+    return false;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, bytes.data(), bytes.size());
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = scale;
+  cinfo.out_color_space = JCS_EXT_BGR;
+  jpeg_start_decompress(&cinfo);
+
+  if (region.empty())
+  {
+    image.create(cinfo.output_height, cinfo.output_width, CV_8UC3);
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+      JSAMPROW row = image.ptr(cinfo.output_scanline);
+      jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+  }
+
+  // region in output pixels, columns are widened by libjpeg to whole iMCUs, rows are exact
+  int x0 = region.x / scale, y0 = region.y / scale;
+  int x1 = (region.x + region.width + scale - 1) / scale, y1 = (region.y + region.height + scale - 1) / scale;
+  cv::Rect scaled = cv::Rect(x0, y0, x1 - x0, y1 - y0) & cv::Rect(0, 0, cinfo.output_width, cinfo.output_height);
+  if (scaled.empty())
+  {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  JDIMENSION xoffset = scaled.x, width = scaled.width;
+  jpeg_crop_scanline(&cinfo, &xoffset, &width);
+  if (scaled.y > 0)
+    jpeg_skip_scanlines(&cinfo, scaled.y);
+
+  // decoded straight into the caller's image, a corrupt stream jumps back past no local object
+  image.create(scaled.height, width, CV_8UC3);
+  for (int y = 0; y < scaled.height; y++)
+  {
+    JSAMPROW row = image.ptr(y);
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  // the rows below the region are never decoded
+  jpeg_abort_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  image = image(cv::Rect(scaled.x - xoffset, 0, scaled.width, scaled.height));
+  return true;
+}
+
+bool QGLoader::load_pair(const Params& params, const std::vector<unsigned char>& bytesU, const std::vector<unsigned char>& bytesD,
+  cv::Mat& imgU, cv::Mat& imgD, int& scale, size_t& decoded_bytes)
+{
+  auto decoded = [&]() { return imgU.total() * imgU.elemSize() + imgD.total() * imgD.elemSize(); };
+
+  scale = 1;
+  cv::Size sizeU, sizeD;
+  bool jpegs = QGLoader::jpeg_size(bytesU, sizeU) && QGLoader::jpeg_size(bytesD, sizeD);
+  if (jpegs && params.reduced)
+  {
+    // the used half of each view has to keep the detector input size, the classifier needs less
+    cv::Size region(std::min(sizeU.width, sizeD.width) / (params.aligned ? 1 : 2), std::min(sizeU.height, sizeD.height));
+    scale = reduction(region, params.need);
+  }
+
+  if (params.aligned)
+  {
+    if (!decode(bytesU, scale, imgU) || !decode(bytesD, scale, imgD))
+    {
+      scale = 1;
+      if (!decode(bytesU, 1, imgU) || !decode(bytesD, 1, imgD))
+        return false;
+    }
+    decoded_bytes = decoded();
+    return imgU.size() == imgD.size();
+  }
+
+  if (jpegs && params.cropped)
+  {
+    cv::Rect regionU, regionD;
+    QGGrader::regions(sizeU, sizeD, regionU, regionD);
+    if (decode(bytesU, scale, imgU, regionU) && decode(bytesD, scale, imgD, regionD))
+    {
+      decoded_bytes = decoded();
+      QGGrader::align_regions(imgU, imgD);
+      return true;
+    }
+  }
+
+  if (!decode(bytesU, scale, imgU) || !decode(bytesD, scale, imgD))
+  {
+    scale = 1;
+    if (!decode(bytesU, 1, imgU) || !decode(bytesD, 1, imgD))
+      return false;
+  }
+  decoded_bytes = decoded();
+  QGGrader::align(imgU, imgD, 1.0f / scale);
+  return true;
+}
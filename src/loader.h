@@ -0,0 +1,35 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+
+// JPEG decoding through libjpeg-turbo, which can scale by 1/2, 1/4 or 1/8 in the DCT domain
+// and skip the rows and columns outside of a region for a fraction of the full decode cost.
+// Other formats are decoded by OpenCV at full size.
+class QGLoader
+{
+public:
+  typedef struct Params
+  {
+    bool reduced = false;  /* largest scale at which the used views still cover need */
+    bool cropped = false;  /* only the regions of the views that align() keeps */
+    bool aligned = false;  /* views stored aligned already, e.g. by a packed lot */
+    cv::Size need = cv::Size(640, 640);
+    Params() {}
+  } Params;
+
+public:
+  // size of a JPEG from its header, false for other formats.
+  static bool jpeg_size(const std::vector<unsigned char>& bytes, cv::Size& size);
+  // largest of 1, 2, 4, 8 at which a region still covers need.
+  static int reduction(const cv::Size& region, const cv::Size& need);
+  // BGR image at 1/scale of the full size, only 1 for formats other than JPEG.
+  // a non empty region, in full size pixels, limits decoding to it and the image to its scaled extent.
+  static bool decode(const std::vector<unsigned char>& bytes, int scale, cv::Mat& image, const cv::Rect& region = cv::Rect());
+
+  // decodes and aligns the views of a pair, boxes found on them are 1/scale of the full resolution ones.
+  // decoded_bytes is the size of the decoded pixels, before alignment.
+  static bool load_pair(const Params& params, const std::vector<unsigned char>& bytesU, const std::vector<unsigned char>& bytesD,
+    cv::Mat& imgU, cv::Mat& imgD, int& scale, size_t& decoded_bytes);
+};
@@ -6,41 +6,43 @@
 #include "timer.hpp"
 #include "detector.h"
 #include "classifier.h"
+#include "benchmark.h"
+#include "stream.h"
+#include "grader.h"
+#include "quantize.h"
+#include "backend.hpp"
+#include "config.hpp"
+#include "kernels.h"
+#include "cache.h"
+#include "results.h"
+#include "tensorcache.h"
+#include "evaluator.h"
+#include "realtime.hpp"
+#include "numa.h"
+#include "hash.hpp"
+#include "batch.h"
+#include "archive.h"
+#include "dataset.hpp"
 
 #include <vector>
 #include <string>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <iostream>
 
 #include <dirent.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <signal.h>
 #include <sys/stat.h>
 
-inline std::vector<std::string> getlistdir(const std::string& path, unsigned int st_mode)
-{
-  std::vector<std::string> list;
-  struct dirent* dir;
-  DIR* d;
-  struct stat st;
-  if (d = opendir(path.c_str()))
-  {
-    while (dir = readdir(d))
-    {
-      const char* name = dir->d_name;
-      if (stat((path + "/" + name).c_str(), &st) == 0 && (st.st_mode & st_mode) && ((st.st_mode & S_IFDIR) != S_IFDIR || (strcmp(name, ".") && strcmp(name, ".."))))
-        list.push_back(name);
-    }
-    closedir(d);
-  }
-  return list;
-}
-
-
-
 const char* APP_WINDOW_NAME = "Q-GRADER";
 
+// the images daemon finishes its pass and exits on SIGINT or SIGTERM
+static volatile sig_atomic_t daemon_stop = 0;
+static void stop_daemon(int) { daemon_stop = 1; }
+
 std::vector<std::string> detect_labels =
 {
   "COFFEE BEAN", "FOREIGN MATTER",
@@ -53,132 +55,441 @@ std::vector<std::string> classify_labels =
   "OVER-DRIED, FLOATER", "SHELL", "FOREIGN MATTER",
 };
 
-float UD_SCALE = 1.064f;
-int UD_TRANS[2] = { 48, 18 };
-
-cv::Rect unionbox(std::vector<cv::Rect> boxes)
-{
-  int x = boxes[0].x, y = boxes[0].y, w = boxes[0].width, h = boxes[0].height;
-  for (auto box : boxes)
-  {
-    x = std::min(x, box.x);
-    y = std::min(y, box.y);
-    w = std::max(w, box.width);
-    h = std::max(h, box.height);
-  }
-
-  return cv::Rect(x, y, w, h);
-}
-
 int main(int argc, const char** argv, char* envpp[])
 {
   ArgumentParser parser;
 
   //**** Input ****//
-  parser.add_argument("-t", "--input_type", 1, "camera", "camera, video, images");
+  parser.add_argument("-c", "--config", 1, "", "file of \"option = value\" lines, the command line overrides it");
+  parser.add_argument("-t", "--input_type", 1, "camera", "camera, video, images, benchmark, calibrate, quantcompare, merge, pack");
   parser.add_argument("-i", "--input", 1, "0", "camera id or video file name, images directory", true);
-  parser.parse_args(argc, argv);
+  parser.add_argument("--display", 0, "", "show graded frames in camera and video modes");
+  parser.add_argument("-o", "--output", 1, "calibration", "output directory of the calibration set or of the packed lots");
+
+  //**** Models ****//
+  parser.add_argument("--detector", 1, "models/coffee-detector.mnn", "detector model");
+  parser.add_argument("--classifier", 1, "models/coffee-clssifier.mnn", "classifier model");
+  parser.add_argument("--int8_detector", 1, "models/coffee-detector-int8.mnn", "quantized detector model for quantcompare");
+  parser.add_argument("--int8_classifier", 1, "models/coffee-clssifier-int8.mnn", "quantized classifier model for quantcompare");
+  parser.add_argument("--calib_count", 1, "500", "image pairs sampled for calibrate and quantcompare, 0 for all");
+  for (std::string model : { "det", "cls" })
+  {
+    parser.add_argument("--" + model + "_threads", 1, "2", model + " threads");
+    parser.add_argument("--" + model + "_forward", 1, "cpu", model + " backend: cpu, auto, opencl, vulkan, opengl, cuda, metal, nn");
+    parser.add_argument("--" + model + "_precision", 1, "low", model + " precision: normal, high, low");
+    parser.add_argument("--" + model + "_power", 1, "normal", model + " power mode: normal, high, low");
+    parser.add_argument("--" + model + "_memory", 1, "normal", model + " memory mode: normal, high, low");
+  }
+
+  //**** Detector ****//
+  parser.add_argument("--tile_size", 1, "0", "tile size for high resolution frames, 0 to disable tiling");
+  parser.add_argument("--tile_overlap", 1, "64", "overlap between neighbouring tiles in pixels");
+  parser.add_argument("--tile_threads", 1, "1", "number of tiles inferred in parallel");
+  parser.add_argument("--nms_top_k", 1, "300", "candidates kept per class before nms, 0 keeps all");
+  parser.add_argument("--max_detections", 1, "0", "boxes kept per frame after nms, 0 keeps all");
+  parser.add_argument("--coarse_sizes", '*', "", "square detector input sizes tried before 640, e.g. 256 320, escalating on ambiguous results");
+  parser.add_argument("--escalate_score", 1, "0.5", "a coarse detection whose best score in a view is lower escalates to the next size");
+  parser.add_argument("--realtime", 0, "", "camera and video modes lock model and tensor memory and pin threads to --capture_cpus and --infer_cpus");
+  parser.add_argument("--capture_cpus", 1, "", "cpus of the capture and preprocess thread in real-time mode, e.g. 2 or 2-3");
+  parser.add_argument("--infer_cpus", 1, "", "cpus of the inference thread and the MNN thread pool in real-time mode, e.g. 4-7");
+  parser.add_argument("--rt_priority", 1, "0", "SCHED_FIFO priority 1-99 of the real-time threads, 0 keeps the default policy");
+  parser.add_argument("--numa", 0, "", "images mode grades with one process per NUMA node, bound to its cores, as shards merged into --results");
+  parser.add_argument("--numa_nodes", 1, "0", "NUMA nodes used, 0 for all, 1 records the baseline of the scaling report");
+  parser.add_argument("--numa_history", 1, "output/numa_scaling.txt", "runs by node count for the NUMA scaling report");
+  parser.add_argument("--model_poll", 1, "2000", "camera, video and daemon modes check the model files every so many ms and reload changed ones in the background, 0 never");
+  parser.add_argument("--daemon", 0, "", "images mode keeps grading new pairs as they arrive, incrementally, every --daemon_interval seconds");
+  parser.add_argument("--daemon_interval", 1, "10", "seconds between the passes of the images daemon");
+  parser.add_argument("--warmup_runs", 1, "3", "inferences on noise per session and input size at init, first and steady latencies are logged");
+  parser.add_argument("--buffers", 1, "2", "input buffers in camera and video modes, preprocessing of the next frame overlaps inference");
+
+  parser.add_argument("--skip_rules", '*', "", "detect_label:min_score:classify_label, e.g. 1:0.9:10 grades confident foreign matter without classifying");
+  parser.add_argument("--skip_dry_run", 0, "", "classify anyway and report how often the skip rules disagree");
+  parser.add_argument("--results", 1, "", "per pair results file in images mode");
+  parser.add_argument("--results_format", 1, "jsonl", "results format: jsonl, csv, bin");
+  parser.add_argument("--top_k", 1, "3", "classifier labels kept per pair in the results");
+  parser.add_argument("--shard", 1, "0/1", "i/N grades the i-th of N shards of the pairs, results and cache files get a .i-of-N suffix");
+  parser.add_argument("--shard_results", '*', "", "shard results files combined by merge into --results");
+  parser.add_argument("--write_images", 0, "", "write annotated pairs under output/<date>/<lot> in images mode");
+  parser.add_argument("--workers", 1, "1", "grading workers in images mode, they decode on their own and lease detector and classifier sessions to infer");
+  parser.add_argument("--sessions", 1, "0", "detector and classifier sessions shared by the images mode workers, on one model load, 0 for one per worker");
+  parser.add_argument("--reduced_decode", 0, "", "decode JPEGs at 1/2, 1/4 or 1/8 when the used half of a view still covers the detector input, full size with --tile_size");
+  parser.add_argument("--cropped_decode", 0, "", "decode only the regions of the JPEG views that the rig alignment keeps");
+  parser.add_argument("--pack_aligned", 0, "", "pack mode stores the views aligned, re-encoded as JPEG");
+  parser.add_argument("--pack_quality", 1, "95", "JPEG quality of aligned packed views");
+  parser.add_argument("--incremental", 0, "", "images mode grades only pairs missing from or changed since the lot manifests");
+  parser.add_argument("--manifest_dir", 1, "output/manifests", "lot manifests of --incremental and --daemon, kept across days unlike output/<date>");
+  parser.add_argument("--cache", 1, "", "result cache file for images mode, reruns skip pairs whose files and settings are unchanged");
+  parser.add_argument("--cache_size", 1, "256", "size of a new result cache in MB");
+  parser.add_argument("--tensor_cache", 1, "", "preprocessed input cache file for images mode, reruns with other models skip decoding and resizing");
+  parser.add_argument("--tensor_cache_format", 1, "u8", "cached inputs: u8 resized images, f32 network tensors");
+  parser.add_argument("--tensor_cache_size", 1, "4096", "size of a new tensor cache in MB, the file is sparse");
+  parser.add_argument("--evaluate", 1, "", "images mode scores the grades against ground truth: lots (lot directories named after classify labels or NONE) or a lot,name,label CSV");
+  parser.add_argument("--eval_report", 1, "", "JSON evaluation report, output/<date>/evaluation.json by default");
+  parser.add_argument("--isa", 1, "auto", "kernel variant: auto, generic, sse4, avx2, avx512, asimd");
+
+  //**** Benchmark ****//
+  parser.add_argument("--bench_data", 1, "", "benchmark specific data, e.g. candidate counts for nms");
+  parser.parse_args(config_args(parser, argc, argv));
 
   std::string type = parser.retrieve<std::string>("input_type");
   std::string input = parser.retrieve<std::string>("input");
 
-  cv::Scalar crDetect(0, 0, 255);
+  if (!qg_select_kernels(parser.retrieve<std::string>("isa")))
+    return -1;
+  printf("(i)----kernels: %s\n", qg_kernels().name);
+
+  if (type == "benchmark")
+    return QGBenchmark::run(input, parser.retrieve<std::string>("bench_data"));
+
+  int shard_index = 0, shard_count = 1;
+  QGResults::Format results_format;
+  if (!QGResults::parse_shard(parser.retrieve<std::string>("shard"), shard_index, shard_count)
+    || !QGResults::parse_format(parser.retrieve<std::string>("results_format"), results_format))
+  {
+    fprintf(stderr, "(!)----Error: invalid shard or results format, please check!\n");
+    return -1;
+  }
+  if (type == "pack")
+  {
+    // one packed lot per lot directory, images mode reads them from the output directory
+    std::string output = parser.retrieve<std::string>("output");
+    mkdir(output.c_str(), 0755);
+    for (const auto& dir : getlistdir(input, S_IFDIR))
+      if (!QGArchive::pack(input + "/" + dir, output + "/" + dir + QGArchive::EXTENSION,
+        parser.retrieve<bool>("pack_aligned"), parser.retrieve<int>("pack_quality")))
+        return -1;
+    return 0;
+  }
+  if (type == "merge")
+  {
+    if (parser.count("shard_results") == 0 || parser.retrieve<std::string>("results").empty())
+    {
+      fprintf(stderr, "(!)----Error: merge needs --shard_results and --results.\n");
+      return -1;
+    }
+    return QGResults::merge(parser.retrieve_container<std::string>("shard_results"), parser.retrieve<std::string>("results"), results_format);
+  }
 
   QGDetector::Params dparams;
   dparams.num_classes = detect_labels.size();
-  QGDetector detector;
-  detector.init("models/coffee-detector.mnn", dparams);
-
+  dparams.tile_size = parser.retrieve<int>("tile_size");
+  dparams.tile_overlap = parser.retrieve<int>("tile_overlap");
+  dparams.tile_threads = parser.retrieve<int>("tile_threads");
+  if (dparams.tile_size < 0 || (dparams.tile_size > 0 && (dparams.tile_overlap < 0 || dparams.tile_overlap >= dparams.tile_size)))
+  {
+    fprintf(stderr, "(!)----Error: --tile_overlap must be at least 0 and smaller than --tile_size.\n");
+    return -1;
+  }
+  dparams.nms_top_k = parser.retrieve<int>("nms_top_k");
+  dparams.max_detections = parser.retrieve<int>("max_detections");
+  dparams.num_buffers = (type == "camera" || type == "video") ? parser.retrieve<int>("buffers") : 1;
+  if (parser.count("coarse_sizes") > 0)
+    for (const auto& size : parser.retrieve_container<std::string>("coarse_sizes"))
+      dparams.coarse_sizes.push_back(atoi(size.c_str()));
   QGClassifier::Params cparams;
   cparams.num_classes = classify_labels.size();
-  QGClassifier classifier;
-  classifier.init("models/coffee-clssifier.mnn", cparams);
 
-  std::vector<std::string> images;
-  time_t t = time(NULL);
-  struct tm lt = *localtime(&t);
-  if (type == "images")
+  dparams.num_thread = parser.retrieve<int>("det_threads");
+  cparams.num_thread = parser.retrieve<int>("cls_threads");
+  dparams.warmup_runs = cparams.warmup_runs = std::max(0, parser.retrieve<int>("warmup_runs"));
+  if (!parse_forward(parser.retrieve<std::string>("det_forward"), dparams.forward_type)
+    || !parse_mode(parser.retrieve<std::string>("det_precision"), dparams.precision)
+    || !parse_mode(parser.retrieve<std::string>("det_power"), dparams.power)
+    || !parse_mode(parser.retrieve<std::string>("det_memory"), dparams.memory)
+    || !parse_forward(parser.retrieve<std::string>("cls_forward"), cparams.forward_type)
+    || !parse_mode(parser.retrieve<std::string>("cls_precision"), cparams.precision)
+    || !parse_mode(parser.retrieve<std::string>("cls_power"), cparams.power)
+    || !parse_mode(parser.retrieve<std::string>("cls_memory"), cparams.memory))
   {
-    mkdir("output", 0755);
-    std::string outpath = cv::format("output/%04d-%02d-%02d", lt.tm_year + 1900, lt.tm_mon + 1, lt.tm_mday);
-    mkdir(outpath.c_str(), 0755);
+    fprintf(stderr, "(!)----Error: invalid backend option, please check!\n");
+    return -1;
+  }
 
-    std::vector<std::string> subdir = getlistdir(input, S_IFDIR);
-    for (std::string dir : subdir)
+  std::string detector_path = parser.retrieve<std::string>("detector");
+  std::string classifier_path = parser.retrieve<std::string>("classifier");
+  if (type == "calibrate" || type == "quantcompare")
+  {
+    QGQuantize quantize(dparams, cparams);
+    int count = parser.retrieve<int>("calib_count");
+    if (type == "calibrate")
+      return quantize.calibrate(input, parser.retrieve<std::string>("output"), detector_path, count);
+    return quantize.compare(input, detector_path, classifier_path,
+      parser.retrieve<std::string>("int8_detector"), parser.retrieve<std::string>("int8_classifier"), count);
+  }
+
+  if (type == "camera" || type == "video")
+  {
+    // frames are prepared into the input buffers ahead of inference, a tiled frame has no such buffer
+    if (dparams.tile_size > 0)
     {
-      mkdir((outpath + "/" + dir).c_str(), 0755);
+      fprintf(stderr, "(!)----Error: --tile_size is for images mode, camera and video frames are not tiled.\n");
+      return -1;
+    }
 
-      std::vector<std::string> imv1 = getlistdir(input + "/" + dir + "/U", S_IFREG);
-      std::vector<std::string> imv2 = getlistdir(input + "/" + dir + "/D", S_IFREG);
+    // the inference thread is set up before the sessions so that the MNN thread pool inherits it,
+    // memory is locked once the sessions hold their weights and tensors and the capture is open
+    bool realtime = parser.retrieve<bool>("realtime");
+    QGStream::Params sparams;
+    std::vector<int> infer_cpus;
+    if (realtime)
+    {
+      sparams.priority = parser.retrieve<int>("rt_priority");
+      if (!qg_parse_cpus(parser.retrieve<std::string>("capture_cpus"), sparams.capture_cpus)
+        || !qg_parse_cpus(parser.retrieve<std::string>("infer_cpus"), infer_cpus) || sparams.priority < 0 || sparams.priority > 99)
+      {
+        fprintf(stderr, "(!)----Error: invalid real-time cpus or priority, please check!\n");
+        return -1;
+      }
+      qg_realtime_thread("inference", infer_cpus, sparams.priority);
+    }
 
-      std::set<std::string> ims1(std::make_move_iterator(imv1.begin()), std::make_move_iterator(imv1.end()));
-      std::set<std::string> ims2(std::make_move_iterator(imv2.begin()), std::make_move_iterator(imv2.end()));
-      std::set_intersection(ims1.begin(), ims1.end(), ims2.begin(), ims2.end(), std::inserter(images, images.end()));
-      for (std::string name : images)
+    // retrained models are picked up while the stream runs
+    QGReloader<QGDetector> detectors;
+    QGReloader<QGClassifier> classifiers;
+    auto load_detector = [=]() -> std::shared_ptr<QGDetector>
+    {
+      std::shared_ptr<QGDetector> detector(new QGDetector());
+      return detector->init(detector_path, dparams) ? detector : nullptr;
+    };
+    auto load_classifier = [=]() -> std::shared_ptr<QGClassifier>
+    {
+      std::shared_ptr<QGClassifier> classifier(new QGClassifier());
+      return classifier->init(classifier_path, cparams) ? classifier : nullptr;
+    };
+    if (!detectors.init(detector_path, load_detector) || !classifiers.init(classifier_path, load_classifier))
+    {
+      fprintf(stderr, "(!)----Error: failed to load %s or %s.\n", detector_path.c_str(), classifier_path.c_str());
+      return -1;
+    }
+    detectors.watch(parser.retrieve<int>("model_poll"), realtime);
+    classifiers.watch(parser.retrieve<int>("model_poll"), realtime);
+
+    cv::VideoCapture capture;
+    if (type == "camera")
+      capture.open(std::stoi(input));
+    else
+      capture.open(input);
+    if (realtime)
+      qg_lock_memory();
+
+    QGStream stream(detectors, classifiers, detect_labels, classify_labels, sparams);
+    int ret = stream.run(capture, parser.retrieve<bool>("display"));
+    detectors.report("detector");
+    classifiers.report("classifier");
+    return ret;
+  }
+
+  if (type != "images")
+  {
+    fprintf(stderr, "(!)----Error: unknown input type %s.\n", type.c_str());
+    return -1;
+  }
+
+  // node processes continue below as shards, the parent merges what they wrote
+  QGNuma numa;
+  bool numa_mode = parser.retrieve<bool>("numa");
+  // every process would score its own shard, the evaluation is one report over all pairs
+  if (!parser.retrieve<std::string>("evaluate").empty() && (numa_mode || shard_count > 1))
+  {
+    fprintf(stderr, "(!)----Error: --evaluate writes one report, it cannot be combined with --numa or --shard.\n");
+    return -1;
+  }
+  if (numa_mode)
+  {
+    if (shard_count > 1)
+    {
+      fprintf(stderr, "(!)----Error: --numa shards by node, it cannot be combined with --shard.\n");
+      return -1;
+    }
+    mkdir("output", 0755);
+    QGNuma::Params nparams;
+    nparams.max_nodes = parser.retrieve<int>("numa_nodes");
+    nparams.history = parser.retrieve<std::string>("numa_history");
+    int launched = numa.launch(nparams, shard_index, shard_count);
+    if (launched < 0)
+      return -1;
+    if (launched == 0)
+    {
+      int ret = numa.report();
+      std::string results_path = parser.retrieve<std::string>("results");
+      if (!results_path.empty())
       {
-        Timer::GetInstance().tic();
-        cv::Mat imgU = cv::imread(input + "/" + dir + "/U/" + name);
-        cv::Mat imgD = cv::imread(input + "/" + dir + "/D/" + name);
-        cv::Mat infer = cv::Mat::zeros(imgU.size(), imgU.type());
-
-        cv::resize(imgD, imgD, cv::Size(), UD_SCALE, UD_SCALE);
-        imgU = imgU(cv::Rect(0, 0, imgU.cols / 2, imgU.rows));
-        imgD = imgD(cv::Rect(UD_TRANS[0], UD_TRANS[1], imgU.cols, imgU.rows));
-
-        Timer::GetInstance().tic();
-        std::vector<BoxInfo> udinfos = detector.detect(imgU);
-        std::vector<BoxInfo> ddinfos = detector.detect(imgD);
-        Timer::GetInstance().toc("    >>> detection: ");
-
-        if (udinfos.size() != ddinfos.size())
-        {
-          std::vector<BoxInfo> dinfos;
-          if (udinfos.size() > 0 && ddinfos.size() > 0)
-            dinfos = udinfos;
-          else if (udinfos.size() > 0)
-            dinfos = udinfos;
-          else if (ddinfos.size() > 0)
-            dinfos = ddinfos;
-
-          udinfos = dinfos;
-          ddinfos = dinfos;
-        }
-
-        {
-          int w = infer.cols, h = infer.rows;
-          {
-            std::vector<cv::Rect> boxes;
-            for (auto i : udinfos) boxes.push_back(i.bbox);
-            cv::Rect box = unionbox(boxes);
-            infer(cv::Rect(w / 4 - box.width / 2, h / 2 - box.height / 2, box.width, box.height)) = imgU(box);
-            cv::rectangle(imgU, box, crDetect);
-          }
-          {
-            std::vector<cv::Rect> boxes;
-            for (auto i : ddinfos) boxes.push_back(i.bbox);
-            cv::Rect box = unionbox(boxes);
-            infer(cv::Rect(w / 2 + w / 4 - box.width / 2, h / 2 - box.height / 2, box.width, box.height)) = imgD(box);
-            cv::rectangle(imgD, box, crDetect);
-          }
-
-          Timer::GetInstance().tic();
-          auto cinfos = classifier.classify(infer);
-          Timer::GetInstance().toc("    >>> classify: ");
-
-          auto labelid = cinfos[0].labelid;
-          auto& score = cinfos[0].score;
-          auto& label = classify_labels[labelid];
-          cv::hconcat(imgU, imgD, infer);
-          cv::putText(infer, label, cv::Point(30, 60), cv::FONT_HERSHEY_SIMPLEX, 1, crDetect, 2);
-          cv::imwrite(outpath + "/" + dir + "/" + name, infer);
-        }
-
-        Timer::GetInstance().toc("total");
+        std::vector<std::string> inputs;
+        for (int i = 0; i < shard_count; i++)
+          inputs.push_back(QGResults::shard_path(results_path, i, shard_count));
+        if (QGResults::merge(inputs, results_path, results_format) != 0)
+          return -1;
+        for (const auto& path : inputs)
+          remove(path.c_str());
       }
+      return ret;
+    }
+  }
+
+  QGGrader::Params gparams;
+  gparams.skip_dry_run = parser.retrieve<bool>("skip_dry_run");
+  gparams.escalate_score = parser.retrieve<float>("escalate_score");
+  std::vector<std::string> skip_rules;
+  if (parser.count("skip_rules") > 0)
+    skip_rules = parser.retrieve_container<std::string>("skip_rules");
+  for (const auto& text : skip_rules)
+  {
+    QGGrader::SkipRule rule;
+    if (!QGGrader::parse_rule(text, rule) || rule.detect_label < 0 || rule.detect_label >= (int)detect_labels.size()
+      || rule.classify_label < 0 || rule.classify_label >= (int)classify_labels.size())
+    {
+      fprintf(stderr, "(!)----Error: invalid skip rule %s.\n", text.c_str());
+      return -1;
+    }
+    gparams.skip_rules.push_back(rule);
+  }
+
+  QGCache cache;
+  bool cached = !parser.retrieve<std::string>("cache").empty();
+  if (cached)
+  {
+    QGCache::Params kparams;
+    kparams.path = QGResults::shard_path(parser.retrieve<std::string>("cache"), shard_index, shard_count);
+    kparams.max_bytes = (size_t)parser.retrieve<int>("cache_size") << 20;
+    uint64_t config = 0;
+    std::string settings = QGCache::settings(dparams, cparams, gparams);
+    settings += cv::format("decode %d %d\n", parser.retrieve<bool>("reduced_decode") ? 1 : 0, parser.retrieve<bool>("cropped_decode") ? 1 : 0);
+    if (!QGCache::config_key({ detector_path, classifier_path }, settings, config)
+      || !cache.init(kparams, config))
+      return -1;
+  }
+
+  // cached inputs are those of the full size untiled detector, and the classifier ones depend on the detections
+  QGTensorCache tensors;
+  bool tensor_cached = !parser.retrieve<std::string>("tensor_cache").empty();
+  uint64_t tensor_tag = 0;
+  if (tensor_cached)
+  {
+    std::string format = parser.retrieve<std::string>("tensor_cache_format");
+    if ((format != "u8" && format != "f32") || !dparams.coarse_sizes.empty() || dparams.tile_size > 0)
+    {
+      fprintf(stderr, "(!)----Error: tensor cache needs format u8 or f32, and no coarse sizes or tiles.\n");
+      return -1;
     }
+    QGTensorCache::Params tparams;
+    tparams.path = QGResults::shard_path(parser.retrieve<std::string>("tensor_cache"), shard_index, shard_count);
+    tparams.max_bytes = (size_t)parser.retrieve<int>("tensor_cache_size") << 20;
+    tparams.planar = format == "f32";
+    tparams.detector_bytes = (size_t)dparams.width * dparams.height * dparams.channel * (tparams.planar ? sizeof(float) : 1);
+    tparams.classifier_bytes = (size_t)cparams.width * cparams.height * cparams.channel * (tparams.planar ? sizeof(float) : 1);
+    std::string settings = QGTensorCache::settings(cv::Size(dparams.width, dparams.height), cv::Size(cparams.width, cparams.height),
+      tparams.planar, parser.retrieve<bool>("reduced_decode"), parser.retrieve<bool>("cropped_decode"));
+    if (!QGCache::config_key({ detector_path }, QGCache::settings(dparams, cparams, gparams), tensor_tag)
+      || !tensors.init(tparams, qg_hash64(settings)))
+      return -1;
   }
 
+  QGResults results(detect_labels, classify_labels);
+  if (!parser.retrieve<std::string>("results").empty())
+  {
+    QGResults::Params rparams;
+    rparams.path = QGResults::shard_path(parser.retrieve<std::string>("results"), shard_index, shard_count);
+    rparams.format = results_format;
+    rparams.top_k = parser.retrieve<int>("top_k");
+    // incremental runs grade only new pairs, the records of the earlier ones are kept
+    rparams.append = parser.retrieve<bool>("incremental") || parser.retrieve<bool>("daemon");
+    if (!results.open(rparams))
+      return -1;
+  }
 
+  time_t t = time(NULL);
+  struct tm lt = *localtime(&t);
+  mkdir("output", 0755);
+  QGBatch::Params bparams;
+  bparams.input = input;
+  bparams.outpath = cv::format("output/%04d-%02d-%02d", lt.tm_year + 1900, lt.tm_mon + 1, lt.tm_mday);
+  mkdir(bparams.outpath.c_str(), 0755);
+  bparams.workers = parser.retrieve<int>("workers");
+  bparams.sessions = parser.retrieve<int>("sessions");
+  bparams.write_images = parser.retrieve<bool>("write_images");
+  bool daemon = parser.retrieve<bool>("daemon");
+  if (daemon && (numa_mode || !parser.retrieve<std::string>("evaluate").empty()))
+  {
+    fprintf(stderr, "(!)----Error: --daemon cannot be combined with --numa or --evaluate.\n");
+    return -1;
+  }
+  // cache keys hold the model files as they were at start
+  if (daemon && parser.retrieve<int>("model_poll") > 0 && (cached || tensor_cached))
+  {
+    fprintf(stderr, "(!)----Error: --daemon reloads models, use --model_poll 0 with --cache or --tensor_cache.\n");
+    return -1;
+  }
+  // the daemon grades only what earlier passes have not, and follows the model files
+  bparams.incremental = parser.retrieve<bool>("incremental") || daemon;
+  bparams.model_poll_ms = daemon ? parser.retrieve<int>("model_poll") : 0;
+  bparams.manifest_dir = parser.retrieve<std::string>("manifest_dir");
+  if (bparams.incremental && mkdir(bparams.manifest_dir.c_str(), 0755) != 0 && errno != EEXIST)
+  {
+    fprintf(stderr, "(!)----Error: cannot create the manifest directory %s.\n", bparams.manifest_dir.c_str());
+    return -1;
+  }
+  bparams.reduced_decode = parser.retrieve<bool>("reduced_decode");
+  bparams.cropped_decode = parser.retrieve<bool>("cropped_decode");
+  bparams.shard_index = shard_index;
+  bparams.shard_count = shard_count;
+  bparams.tensor_tag = tensor_tag;
+  bparams.detector_path = detector_path;
+  bparams.classifier_path = classifier_path;
+  bparams.dparams = dparams;
+  bparams.cparams = cparams;
+  bparams.gparams = gparams;
+
+  // evaluation grades only the pairs with ground truth, on the same workers
+  QGEvaluator evaluator(detect_labels, classify_labels);
+  bool evaluated = !parser.retrieve<std::string>("evaluate").empty();
+  if (evaluated)
+  {
+    // an incremental run would score only the pairs changed since the last one
+    if (bparams.incremental)
+    {
+      fprintf(stderr, "(!)----Error: --evaluate scores every pair, it cannot be combined with --incremental.\n");
+      return -1;
+    }
+    QGEvaluator::Params eparams;
+    eparams.truth = parser.retrieve<std::string>("evaluate");
+    eparams.report = parser.retrieve<std::string>("eval_report");
+    if (eparams.report.empty())
+      eparams.report = bparams.outpath + "/evaluation.json";
+    eparams.detector_path = detector_path;
+    eparams.classifier_path = classifier_path;
+    if (!evaluator.init(eparams))
+      return -1;
+  }
 
-  return 0;
+  QGBatch batch(detect_labels, classify_labels, cached ? &cache : nullptr, results.opened() ? &results : nullptr,
+    tensor_cached ? &tensors : nullptr, evaluated ? &evaluator : nullptr);
+  if (!batch.init(bparams))
+    return -1;
+  if (daemon)
+  {
+    signal(SIGINT, stop_daemon);
+    signal(SIGTERM, stop_daemon);
+  }
+  int ret = batch.run();
+  if (daemon)
+  {
+    int interval_ms = std::max(1, parser.retrieve<int>("daemon_interval")) * 1000;
+    while (ret == 0 && !daemon_stop)
+    {
+      for (int slept = 0; slept < interval_ms && !daemon_stop; slept += 100)
+        usleep(100 * 1000);
+      if (!daemon_stop)
+        ret = batch.run();
+    }
+    return ret;
+  }
+  if (ret == 0 && numa_mode)
+  {
+    numa.finish(batch.stats());
+    if (shard_count == 1)
+      numa.record(1, batch.stats().processed, batch.stats().elapsed_ms);
+  }
+  if (ret != 0 || !evaluated)
+    return ret;
+  return evaluator.report(std::max(1, bparams.workers), batch.stats().failed, batch.stats().unlabelled, batch.stats().elapsed_ms);
 }
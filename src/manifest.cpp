@@ -0,0 +1,79 @@
+#include "manifest.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+QGManifest::~QGManifest()
+{
+  close();
+}
+
+int QGManifest::open(const std::string& path)
+{
+  close();
+  entries.clear();
+  this->path = path;
+
+  bool torn = false;
+  FILE* existing = fopen(path.c_str(), "r");
+  if (existing)
+  {
+    char line[1024], name[768];
+    while (fgets(line, sizeof(line), existing))
+    {
+      // later lines win, a pair regraded after a change is listed again
+      Entry entry;
+      torn = !strchr(line, '\n');
+      if (!torn && sscanf(line, "%767[^\t]\t%lld %lld %lld %lld", name, &entry.mtimeU, &entry.sizeU, &entry.mtimeD, &entry.sizeD) == 5)
+        entries[name] = entry;
+    }
+    fclose(existing);
+  }
+
+  file = fopen(path.c_str(), "a");
+  if (!file)
+  {
+    fprintf(stderr, "(!)----Error: cannot open manifest %s.\n", path.c_str());
+    return 0;
+  }
+  // a torn line left by a crash is terminated so that the next entry starts on its own line
+  if (torn)
+    fputc('\n', file);
+  return 1;
+}
+
+void QGManifest::close()
+{
+  if (file)
+    fclose(file);
+  file = nullptr;
+}
+
+bool QGManifest::stat_pair(const std::string& lot, const std::string& name, Entry& entry)
+{
+  struct stat stU, stD;
+  if (stat((lot + "/U/" + name).c_str(), &stU) != 0 || stat((lot + "/D/" + name).c_str(), &stD) != 0)
+    return false;
+  entry.mtimeU = stU.st_mtim.tv_sec * 1000000000LL + stU.st_mtim.tv_nsec;
+  entry.sizeU = stU.st_size;
+  entry.mtimeD = stD.st_mtim.tv_sec * 1000000000LL + stD.st_mtim.tv_nsec;
+  entry.sizeD = stD.st_size;
+  return true;
+}
+
+bool QGManifest::done(const std::string& name, const Entry& entry) const
+{
+  auto found = entries.find(name);
+  return found != entries.end() && found->second == entry;
+}
+
+void QGManifest::record(const std::string& name, const Entry& entry)
+{
+  entries[name] = entry;
+  if (!file)
+    file = fopen(path.c_str(), "a");
+  if (!file)
+    return;
+  fprintf(file, "%s\t%lld %lld %lld %lld\n", name.c_str(), entry.mtimeU, entry.sizeU, entry.mtimeD, entry.sizeD);
+  fflush(file);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <map>
+
+// Pairs already graded into an output lot directory, one "name<TAB>mtimeU sizeU mtimeD sizeD" line per pair.
+// A line is appended and flushed once the pair's outputs are written, so a run killed mid-lot
+// resumes after its last finished pair, a torn last line is ignored.
+class QGManifest
+{
+public:
+  typedef struct Entry
+  {
+    long long mtimeU = 0, sizeU = 0;  /* mtime in nanoseconds */
+    long long mtimeD = 0, sizeD = 0;
+    bool operator==(const Entry& other) const
+    {
+      return mtimeU == other.mtimeU && sizeU == other.sizeU && mtimeD == other.mtimeD && sizeD == other.sizeD;
+    }
+  } Entry;
+
+public:
+  ~QGManifest();
+  // loads the entries of an existing manifest and opens it for appending.
+  int open(const std::string& path);
+  // closes the file only, a later record() reopens it.
+  void close();
+
+  // stats the U and D files of a pair, false when one is missing.
+  static bool stat_pair(const std::string& lot, const std::string& name, Entry& entry);
+  // true when the pair was graded from files of the same mtimes and sizes.
+  bool done(const std::string& name, const Entry& entry) const;
+  void record(const std::string& name, const Entry& entry);
+
+private:
+  std::map<std::string, Entry> entries;
+  std::string path;
+  FILE* file = nullptr;
+};
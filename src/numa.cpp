@@ -0,0 +1,167 @@
+#include "numa.h"
+#include "realtime.hpp"
+#include "dataset.hpp"
+
+#include <chrono>
+#include <fstream>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+std::vector<QGNuma::Node> QGNuma::nodes()
+{
+  std::vector<Node> found;
+  std::string root = "/sys/devices/system/node";
+  for (const auto& name : getlistdir(root, S_IFDIR))
+  {
+    if (name.compare(0, 4, "node") != 0 || name.size() == 4 || name.find_first_not_of("0123456789", 4) != std::string::npos)
+      continue;
+    std::ifstream file(root + "/" + name + "/cpulist");
+    std::string text;
+    std::getline(file, text);
+    Node node;
+    node.id = atoi(name.c_str() + 4);
+    // memory only nodes have no cpus
+    if (!qg_parse_cpus(text, node.cpus) || node.cpus.empty())
+      continue;
+    found.push_back(node);
+  }
+  std::sort(found.begin(), found.end(), [](const Node& a, const Node& b) { return a.id < b.id; });
+  return found;
+}
+
+int QGNuma::launch(const Params& params, int& shard_index, int& shard_count)
+{
+  this->params = params;
+  used = nodes();
+  if (params.max_nodes > 0 && (int)used.size() > params.max_nodes)
+    used.resize(params.max_nodes);
+  if (used.size() <= 1)
+  {
+    // a single node is bound all the same, the one node run is the baseline of the scaling report
+    printf("(i)----numa: %d node, grading in one process\n", (int)used.size());
+    if (!used.empty())
+      qg_realtime_thread(cv::format("node %d", used[0].id).c_str(), used[0].cpus, 0);
+    shard_index = 0;
+    shard_count = 1;
+    return 1;
+  }
+
+  int fds[2];
+  if (pipe(fds) != 0)
+  {
+    fprintf(stderr, "(!)----Error: cannot create the numa report pipe.\n");
+    return -1;
+  }
+  // node processes are forked before any thread or model exists
+  fflush(stdout);
+  fflush(stderr);
+  auto start = std::chrono::high_resolution_clock::now();
+  std::vector<pid_t> children;
+  for (size_t i = 0; i < used.size(); i++)
+  {
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+      fprintf(stderr, "(!)----Error: cannot start the process of numa node %d.\n", used[i].id);
+      break;
+    }
+    if (pid == 0)
+    {
+      close(fds[0]);
+      channel = fds[1];
+      node = (int)i;
+      qg_realtime_thread(cv::format("node %d", used[i].id).c_str(), used[i].cpus, 0);
+      shard_index = (int)i;
+      shard_count = (int)used.size();
+      return 1;
+    }
+    children.push_back(pid);
+  }
+  close(fds[1]);
+
+  // reports are smaller than PIPE_BUF, each one arrives whole
+  Report report;
+  while (read(fds[0], &report, sizeof(report)) == (ssize_t)sizeof(report))
+    reports.push_back(report);
+  close(fds[0]);
+  for (pid_t pid : children)
+  {
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      exited++;
+  }
+  wall_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+  if (children.size() != used.size() || exited)
+  {
+    fprintf(stderr, "(!)----Error: %d of %d numa node processes failed.\n", (int)(used.size() - children.size()) + exited, (int)used.size());
+    return -1;
+  }
+  return 0;
+}
+
+void QGNuma::finish(const QGBatch::Stats& stats)
+{
+  if (channel < 0)
+    return;
+  Report report = { node, stats.processed, stats.failed, stats.elapsed_ms };
+  if (write(channel, &report, sizeof(report)) != (ssize_t)sizeof(report))
+    fprintf(stderr, "(!)----Error: cannot report to the numa parent.\n");
+  close(channel);
+  channel = -1;
+}
+
+int QGNuma::report()
+{
+  std::sort(reports.begin(), reports.end(), [](const Report& a, const Report& b) { return a.node < b.node; });
+  // grading time is that of the slowest node, model loading excluded as in a one process run
+  int processed = 0, failed = 0;
+  double elapsed_ms = 0;
+  for (const auto& report : reports)
+  {
+    const Node& info = used[report.node];
+    printf("    >>> numa node %d: %d cpus, %d pairs, %d failed, %f ms, %.1f pairs/s\n", info.id, (int)info.cpus.size(),
+      report.processed, report.failed, report.elapsed_ms, report.elapsed_ms > 0 ? 1000.0 * report.processed / report.elapsed_ms : 0.0);
+    processed += report.processed;
+    failed += report.failed;
+    elapsed_ms = std::max(elapsed_ms, report.elapsed_ms);
+  }
+  printf("    >>> numa: %d nodes, %d pairs, %d failed, %f ms grading, %f ms wall, %.1f pairs/s\n", (int)used.size(), processed, failed,
+    elapsed_ms, wall_ms, elapsed_ms > 0 ? 1000.0 * processed / elapsed_ms : 0.0);
+  return record((int)used.size(), processed, elapsed_ms);
+}
+
+int QGNuma::record(int nodes, int processed, double elapsed_ms)
+{
+  if (params.history.empty())
+    return 0;
+
+  // the speedup is taken over the last one node run recorded, e.g. by --numa_nodes 1
+  double rate = elapsed_ms > 0 ? 1000.0 * processed / elapsed_ms : 0.0;
+  double baseline = 0;
+  std::ifstream input(params.history);
+  std::string line;
+  while (std::getline(input, line))
+  {
+    int count = 0, pairs = 0;
+    double ms = 0, pairs_per_s = 0;
+    if (sscanf(line.c_str(), "%d %d %lf %lf", &count, &pairs, &ms, &pairs_per_s) == 4 && count == 1)
+      baseline = pairs_per_s;
+  }
+  input.close();
+  if (nodes > 1 && baseline > 0)
+    printf("    >>> numa scaling: %.2fx one node (%.1f pairs/s), %.1f%% efficiency over %d nodes\n",
+      rate / baseline, baseline, 100.0 * rate / baseline / nodes, nodes);
+  else if (nodes > 1)
+    printf("    >>> numa scaling: no one node run in %s yet, run with --numa_nodes 1 for the baseline\n", params.history.c_str());
+
+  FILE* file = fopen(params.history.c_str(), "a");
+  if (!file)
+  {
+    fprintf(stderr, "(!)----Error: cannot write %s.\n", params.history.c_str());
+    return -1;
+  }
+  fprintf(file, "%d %d %f %f\n", nodes, processed, elapsed_ms, rate);
+  fclose(file);
+  return 0;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "batch.h"
+
+#include <string>
+#include <vector>
+
+// One grading process per NUMA node for images mode. Each process is bound to the cores of its
+// node before any model is loaded, so that its sessions, tensors and MNN threads are allocated
+// and run node locally by first touch, and grades one shard of the pairs. The parent waits for
+// them, merges their results and reports the scaling over the nodes.
+class QGNuma
+{
+public:
+  typedef struct Node
+  {
+    int id;
+    std::vector<int> cpus;
+  } Node;
+
+  typedef struct Params
+  {
+    int max_nodes = 0;       /* nodes used, 0 for all */
+    std::string history;     /* runs appended as nodes, pairs, wall ms, pairs/s, for the scaling report */
+    Params() {}
+  } Params;
+
+protected:
+  typedef struct Report
+  {
+    int node;
+    int processed;
+    int failed;
+    double elapsed_ms;
+  } Report;
+
+public:
+  // nodes with cpus from sysfs, empty on a system without NUMA information.
+  static std::vector<Node> nodes();
+
+  // forks one process per node. returns 1 in a node process with its shard set, and in the
+  // process itself when there is a single node, 0 in the parent once every node process exited,
+  // -1 on failure.
+  int launch(const Params& params, int& shard_index, int& shard_count);
+  // sends the figures of a node process to the parent.
+  void finish(const QGBatch::Stats& stats);
+  // parent: per node and overall throughput, and the speedup over the last one node run.
+  int report();
+  // appends a run to the history and prints its speedup over the last one node run.
+  int record(int nodes, int processed, double elapsed_ms);
+
+private:
+  Params params;
+  std::vector<Node> used;
+  int node = -1;   /* index in used of a node process */
+  int channel = -1;
+  std::vector<Report> reports;
+  int exited = 0;  /* node processes with a non zero exit */
+  double wall_ms = 0;
+};
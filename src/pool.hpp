@@ -0,0 +1,137 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "detector.h"
+#include "classifier.h"
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <string>
+#include <stdio.h>
+
+// A fixed set of model instances handed out to threads one at a time. The model is loaded once,
+// every instance runs its own sessions on the runtime of the first one, see QGDetector::init(const QGDetector&).
+// A lease returns its instance when it goes out of scope.
+template <class Model>
+class QGPool
+{
+public:
+  typedef struct Stats
+  {
+    int leases = 0;
+    int waited = 0;        /* leases that found every instance taken */
+    double wait_ms = 0;
+    double max_wait_ms = 0;
+  } Stats;
+
+  class Lease
+  {
+  public:
+    Lease() {}
+    Lease(Lease&& other) : pool(other.pool), index(other.index) { other.pool = nullptr; }
+    Lease& operator=(Lease&& other)
+    {
+      release();
+      pool = other.pool;
+      index = other.index;
+      other.pool = nullptr;
+      return *this;
+    }
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+    ~Lease() { release(); }
+
+    Model& operator*() const { return *pool->models[index]; }
+    Model* operator->() const { return pool->models[index].get(); }
+    explicit operator bool() const { return pool != nullptr; }
+    void release()
+    {
+      if (pool)
+        pool->put(index);
+      pool = nullptr;
+    }
+
+  private:
+    friend class QGPool;
+    Lease(QGPool* pool, int index) : pool(pool), index(index) {}
+    QGPool* pool = nullptr;
+    int index = 0;
+  };
+
+public:
+  template <class Params>
+  int init(const std::string& model_path, const Params& params, int size)
+  {
+    models.clear();
+    available.clear();
+    for (int i = 0; i < std::max(1, size); i++)
+    {
+      std::unique_ptr<Model> model(new Model());
+      if (!(i == 0 ? model->init(model_path, params) : model->init(*models[0])))
+        return 0;
+      models.push_back(std::move(model));
+      available.push_back(i);
+    }
+    return 1;
+  }
+
+  // blocks until an instance is free.
+  Lease acquire()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    bool waiting = available.empty();
+    auto start = std::chrono::high_resolution_clock::now();
+    cond.wait(lock, [this]() { return !available.empty(); });
+    int index = available.back();
+    available.pop_back();
+    counts.leases++;
+    if (waiting)
+    {
+      double wait_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+      counts.waited++;
+      counts.wait_ms += wait_ms;
+      counts.max_wait_ms = std::max(counts.max_wait_ms, wait_ms);
+    }
+    return Lease(this, index);
+  }
+
+  int size() const { return (int)models.size(); }
+  Model& at(int index) { return *models[index]; }
+  Stats stats() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counts;
+  }
+
+  void report(const char* name) const
+  {
+    Stats stats = this->stats();
+    printf("    >>> %s pool: %d instances, %d leases, %d waited (%.1f%%), mean wait: %f ms, max wait: %f ms\n", name, size(),
+      stats.leases, stats.waited, stats.leases ? 100.0 * stats.waited / stats.leases : 0.0,
+      stats.waited ? stats.wait_ms / stats.waited : 0.0, stats.max_wait_ms);
+  }
+
+private:
+  void put(int index)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      available.push_back(index);
+    }
+    cond.notify_one();
+  }
+
+  std::vector<std::unique_ptr<Model>> models;
+  std::vector<int> available;
+  Stats counts;
+  mutable std::mutex mutex;
+  std::condition_variable cond;
+};
+
+typedef QGPool<QGDetector> QGDetectorPool;
+typedef QGPool<QGClassifier> QGClassifierPool;
+
+#endif //POOL_H
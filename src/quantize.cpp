@@ -0,0 +1,210 @@
+#include "quantize.h"
+#include "grader.h"
+#include "dataset.hpp"
+
+#include <chrono>
+#include <fstream>
+
+QGQuantize::QGQuantize(const QGDetector::Params& dparams, const QGClassifier::Params& cparams)
+  : dparams(dparams), cparams(cparams)
+{
+}
+
+std::vector<std::pair<std::string, std::string>> QGQuantize::sample(const std::string& dataset, int count)
+{
+  std::vector<std::pair<std::string, std::string>> pairs;
+  std::vector<std::string> lots = getlistdir(dataset, S_IFDIR);
+  std::sort(lots.begin(), lots.end());
+  for (const auto& lot : lots)
+    for (const auto& name : listpairs(dataset + "/" + lot))
+      pairs.push_back({ lot, name });
+
+  // evenly spaced over the lots, so that every lot contributes
+  if (count > 0 && (int)pairs.size() > count)
+  {
+    std::vector<std::pair<std::string, std::string>> sampled;
+    for (int i = 0; i < count; i++)
+      sampled.push_back(pairs[(size_t)i * pairs.size() / count]);
+    pairs.swap(sampled);
+  }
+  return pairs;
+}
+
+static void write_config(const std::string& path, const std::string& images, int width, int height, float mean, float normal, int count)
+{
+  std::ofstream config(path);
+  config << "{\n"
+    << "  \"format\": \"RGB\",\n"
+    << "  \"mean\": [" << mean << ", " << mean << ", " << mean << "],\n"
+    << "  \"normal\": [" << normal << ", " << normal << ", " << normal << "],\n"
+    << "  \"width\": " << width << ",\n"
+    << "  \"height\": " << height << ",\n"
+    << "  \"path\": \"" << images << "/\",\n"
+    << "  \"used_image_num\": " << count << ",\n"
+    << "  \"feature_quantize_method\": \"KL\",\n"
+    << "  \"weight_quantize_method\": \"MAX_ABS\"\n"
+    << "}\n";
+}
+
+int QGQuantize::calibrate(const std::string& dataset, const std::string& output, const std::string& detector_path, int count)
+{
+  QGDetector detector;
+  QGClassifier classifier;
+  if (!detector.init(detector_path, dparams))
+  {
+    fprintf(stderr, "(!)----Error: failed to load %s.\n", detector_path.c_str());
+    return -1;
+  }
+  QGGrader grader(detector, classifier);
+
+  std::string detector_dir = output + "/detector", classifier_dir = output + "/classifier";
+  mkdir(output.c_str(), 0755);
+  mkdir(detector_dir.c_str(), 0755);
+  mkdir(classifier_dir.c_str(), 0755);
+
+  // samples are stored at the model input size with the runtime's resize, so that the tool's own
+  // resize is an identity and only the normalization below is left to it.
+  int detector_count = 0, classifier_count = 0;
+  GradeInfo info;
+  cv::Mat resized;
+  for (const auto& pair : sample(dataset, count))
+  {
+    cv::Mat imgU = cv::imread(dataset + "/" + pair.first + "/U/" + pair.second);
+    cv::Mat imgD = cv::imread(dataset + "/" + pair.first + "/D/" + pair.second);
+    if (imgU.empty() || imgD.empty())
+      continue;
+    QGGrader::align(imgU, imgD);
+
+    std::string stem = pair.first + "_" + pair.second.substr(0, pair.second.find_last_of('.'));
+    cv::resize(imgU, resized, cv::Size(dparams.width, dparams.height));
+    cv::imwrite(detector_dir + "/" + stem + "_U.png", resized);
+    cv::resize(imgD, resized, cv::Size(dparams.width, dparams.height));
+    cv::imwrite(detector_dir + "/" + stem + "_D.png", resized);
+    detector_count += 2;
+
+    grader.detect(imgU, imgD, info);
+    if (grader.compose(imgU, imgD, info))
+    {
+      cv::resize(info.infer, resized, cv::Size(cparams.width, cparams.height));
+      cv::imwrite(classifier_dir + "/" + stem + ".png", resized);
+      classifier_count++;
+    }
+  }
+
+  write_config(output + "/detector.json", detector_dir, dparams.width, dparams.height, 0.0f, 1.0f / 255, detector_count);
+  write_config(output + "/classifier.json", classifier_dir, cparams.width, cparams.height, 127.5f, 1.0f / 127.5, classifier_count);
+
+  printf("calibration: %d detector and %d classifier samples in %s\n", detector_count, classifier_count, output.c_str());
+  printf("  quantized.out <float detector.mnn> <int8 detector.mnn> %s/detector.json\n", output.c_str());
+  printf("  quantized.out <float classifier.mnn> <int8 classifier.mnn> %s/classifier.json\n", output.c_str());
+  return 0;
+}
+
+static float iou(const cv::Rect& a, const cv::Rect& b)
+{
+  float inner = (a & b).area();
+  float outer = a.area() + b.area() - inner;
+  return outer > 0 ? inner / outer : 0;
+}
+
+// boxes of reference found in boxes with the same label and an IoU of at least 0.5
+static int matched(const std::vector<BoxInfo>& reference, const std::vector<BoxInfo>& boxes)
+{
+  int count = 0;
+  for (const auto& ref : reference)
+    for (const auto& box : boxes)
+      if (box.labelid == ref.labelid && iou(box.bbox, ref.bbox) >= 0.5f)
+      {
+        count++;
+        break;
+      }
+  return count;
+}
+
+int QGQuantize::compare(const std::string& dataset, const std::string& detector_path, const std::string& classifier_path,
+  const std::string& int8_detector_path, const std::string& int8_classifier_path, int count)
+{
+  QGDetector detector, int8_detector;
+  QGClassifier classifier, int8_classifier;
+  if (!detector.init(detector_path, dparams) || !int8_detector.init(int8_detector_path, dparams)
+    || !classifier.init(classifier_path, cparams) || !int8_classifier.init(int8_classifier_path, cparams))
+  {
+    fprintf(stderr, "(!)----Error: failed to load the float or int8 models.\n");
+    return -1;
+  }
+  QGGrader grader(detector, classifier);
+
+  auto elapsed = [](std::chrono::high_resolution_clock::time_point t0)
+  {
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+  };
+
+  int pairs = 0, classified = 0, agreed = 0;
+  int float_boxes = 0, int8_boxes = 0, float_matched = 0, int8_matched = 0;
+  double detect_ms[2] = { 0, 0 }, classify_ms[2] = { 0, 0 }, score_delta = 0;
+  GradeInfo info;
+  std::vector<BoxInfo> boxes;
+  std::vector<ClassInfo> cinfos;
+  for (const auto& pair : sample(dataset, count))
+  {
+    cv::Mat imgU = cv::imread(dataset + "/" + pair.first + "/U/" + pair.second);
+    cv::Mat imgD = cv::imread(dataset + "/" + pair.first + "/D/" + pair.second);
+    if (imgU.empty() || imgD.empty())
+      continue;
+    QGGrader::align(imgU, imgD);
+    pairs++;
+
+    for (int view = 0; view < 2; view++)
+    {
+      std::vector<BoxInfo>& dinfos = view == 0 ? info.udinfos : info.ddinfos;
+      auto t0 = std::chrono::high_resolution_clock::now();
+      detector.detect(view == 0 ? imgU : imgD, dinfos);
+      detect_ms[0] += elapsed(t0);
+
+      t0 = std::chrono::high_resolution_clock::now();
+      int8_detector.detect(view == 0 ? imgU : imgD, boxes);
+      detect_ms[1] += elapsed(t0);
+
+      float_boxes += dinfos.size();
+      int8_boxes += boxes.size();
+      float_matched += matched(dinfos, boxes);
+      int8_matched += matched(boxes, dinfos);
+    }
+
+    // both classifiers see the same composition, built from the float detections
+    QGGrader::reconcile(info);
+    if (!grader.compose(imgU, imgD, info))
+      continue;
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+    classifier.classify(info.infer, info.cinfos);
+    classify_ms[0] += elapsed(t0);
+
+    t0 = std::chrono::high_resolution_clock::now();
+    int8_classifier.classify(info.infer, cinfos);
+    classify_ms[1] += elapsed(t0);
+
+    classified++;
+    agreed += info.cinfos[0].labelid == cinfos[0].labelid ? 1 : 0;
+    for (const auto& cinfo : cinfos)
+      if (cinfo.labelid == info.cinfos[0].labelid)
+        score_delta += std::abs(cinfo.score - info.cinfos[0].score);
+  }
+
+  if (pairs == 0)
+  {
+    fprintf(stderr, "(!)----Error: no image pairs found in %s.\n", dataset.c_str());
+    return -1;
+  }
+
+  printf("int8 vs float on %d pairs\n", pairs);
+  printf("  detector:   float %8.3f ms, int8 %8.3f ms, speedup %5.2fx, recall %6.2f%%, precision %6.2f%% (%d vs %d boxes)\n",
+    detect_ms[0] / (2 * pairs), detect_ms[1] / (2 * pairs), detect_ms[0] / detect_ms[1],
+    float_boxes ? 100.0 * float_matched / float_boxes : 100.0, int8_boxes ? 100.0 * int8_matched / int8_boxes : 100.0,
+    int8_boxes, float_boxes);
+  if (classified > 0)
+    printf("  classifier: float %8.3f ms, int8 %8.3f ms, speedup %5.2fx, top-1 agreement %6.2f%%, mean score delta %.4f\n",
+      classify_ms[0] / classified, classify_ms[1] / classified, classify_ms[0] / classify_ms[1],
+      100.0 * agreed / classified, score_delta / classified);
+  return 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "detector.h"
+#include "classifier.h"
+
+#include <string>
+
+class QGQuantize
+{
+public:
+  QGQuantize(const QGDetector::Params& dparams, const QGClassifier::Params& cparams);
+
+  // writes up to count aligned views and composed classifier inputs, already resized to the model
+  // inputs, with the json configs expected by MNN's quantized.out tool.
+  int calibrate(const std::string& dataset, const std::string& output, const std::string& detector_path, int count);
+
+  // grades up to count pairs with the float and the int8 models side by side,
+  // reports agreement of the int8 models with the float ones and the speedup per model.
+  int compare(const std::string& dataset, const std::string& detector_path, const std::string& classifier_path,
+    const std::string& int8_detector_path, const std::string& int8_classifier_path, int count);
+
+private:
+  std::vector<std::pair<std::string, std::string>> sample(const std::string& dataset, int count);
+
+  QGDetector::Params dparams;
+  QGClassifier::Params cparams;
+};
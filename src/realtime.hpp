@@ -0,0 +1,130 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+// Real-time setup of the sorting line threads. Every step reports what it could not do and
+// leaves the thread as it was, an unprivileged process keeps running with the defaults.
+
+// cpu list as in sysfs and taskset, e.g. "2" or "0-3,6", empty text is an empty list.
+inline bool qg_parse_cpus(const std::string& text, std::vector<int>& cpus)
+{
+  cpus.clear();
+  size_t start = 0;
+  while (start < text.size())
+  {
+    size_t comma = text.find(',', start);
+    std::string range = text.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+    start = comma == std::string::npos ? text.size() : comma + 1;
+
+    char* end = nullptr;
+    long first = strtol(range.c_str(), &end, 10);
+    long last = first;
+    if (end == range.c_str())
+      return false;
+    if (*end == '-')
+    {
+      const char* next = end + 1;
+      last = strtol(next, &end, 10);
+      if (end == next)
+        return false;
+    }
+    if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+      return false;
+    for (long cpu = first; cpu <= last; cpu++)
+      cpus.push_back((int)cpu);
+  }
+  return true;
+}
+
+// pins the calling thread to cpus and, for a priority of 1 to 99, runs it under SCHED_FIFO.
+// threads it creates afterwards inherit both, the MNN thread pool included when the calling
+// thread creates the sessions.
+inline bool qg_realtime_thread(const char* role, const std::vector<int>& cpus, int priority)
+{
+  bool complete = true;
+  if (!cpus.empty())
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+      CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error)
+    {
+      fprintf(stderr, "(i)----real-time: cannot pin the %s thread (%s), it floats across cores.\n", role, strerror(error));
+      complete = false;
+    }
+  }
+  if (priority > 0)
+  {
+    sched_param param = {};
+    param.sched_priority = std::min(priority, sched_get_priority_max(SCHED_FIFO));
+    int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (error)
+    {
+      fprintf(stderr, "(i)----real-time: no SCHED_FIFO for the %s thread (%s)%s, it keeps the default policy.\n", role, strerror(error),
+        error == EPERM ? ", needs CAP_SYS_NICE or an rtprio limit" : "");
+      complete = false;
+    }
+  }
+  if (complete && priority > 0 && cpus.empty())
+    printf("(i)----real-time: %s thread SCHED_FIFO priority %d\n", role, priority);
+  else if (complete && priority > 0)
+    printf("(i)----real-time: %s thread on %d cpus, SCHED_FIFO priority %d\n", role, (int)cpus.size(), priority);
+  else if (complete && !cpus.empty())
+    printf("(i)----real-time: %s thread on %d cpus\n", role, (int)cpus.size());
+  return complete;
+}
+
+// returns the calling thread to the default policy on every core, for background work started
+// from a real-time thread whose setup it would otherwise inherit.
+inline bool qg_normal_thread(const char* role)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    CPU_SET(cpu, &set);
+  sched_param param = {};
+  // cpus outside the cpuset of the process are left out by the kernel
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (!error)
+    error = pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+  if (error)
+    fprintf(stderr, "(i)----real-time: cannot return the %s thread to the default policy (%s).\n", role, strerror(error));
+  return !error;
+}
+
+// locks the pages mapped so far, model weights and session tensors once the sessions are
+// initialized, so that they are never paged out. later allocations stay unlocked until it is
+// called again, e.g. once a reloaded model is in place.
+inline bool qg_lock_memory()
+{
+  if (mlockall(MCL_CURRENT) == 0)
+  {
+    printf("(i)----real-time: memory locked\n");
+    return true;
+  }
+  int error = errno;
+  struct rlimit limit;
+  getrlimit(RLIMIT_MEMLOCK, &limit);
+  if (limit.rlim_cur == RLIM_INFINITY)
+    fprintf(stderr, "(i)----real-time: cannot lock memory (%s), pages may be evicted.\n", strerror(error));
+  else
+    fprintf(stderr, "(i)----real-time: cannot lock memory (%s, memlock limit %llu KB), pages may be evicted.\n",
+      strerror(error), (unsigned long long)limit.rlim_cur >> 10);
+  return false;
+}
+
+#endif //REALTIME_H
@@ -0,0 +1,158 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include <memory>
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+
+#include <sys/stat.h>
+
+#include "realtime.hpp"
+
+// A model, or a pool of instances of one, that follows its file. A watcher thread polls the
+// file and, once a change has settled for one interval, loads and warms the new version in the
+// background and switches get() over to it. Callers keep the version they got until they drop
+// it, so work in flight finishes on the old one. A failed load keeps the old version running
+// and is not retried until the file changes again.
+template <class T>
+class QGReloader
+{
+public:
+  typedef std::function<std::shared_ptr<T>()> Loader;  /* null on failure */
+
+  ~QGReloader() { stop(); }
+
+  // first load, on the calling thread.
+  int init(const std::string& path, const Loader& loader)
+  {
+    this->path = path;
+    this->loader = loader;
+    std::shared_ptr<T> loaded = loader();
+    if (!loaded)
+      return 0;
+    stamp(loaded_stamp);
+    std::atomic_store(&current, loaded);
+    return 1;
+  }
+
+  std::shared_ptr<T> get() const { return std::atomic_load(&current); }
+  int generation() const { return generations; }
+
+  // polls the file every interval_ms until stop(). started from a real-time thread, the watcher
+  // leaves its cores and policy so that loads do not compete with inference, and locks the memory
+  // of every reloaded version.
+  void watch(int interval_ms, bool realtime = false)
+  {
+    if (interval_ms <= 0 || watcher.joinable())
+      return;
+    stopping = false;
+    this->realtime = realtime;
+    watcher = std::thread([this, interval_ms]()
+      {
+        if (this->realtime)
+          qg_normal_thread("model reload");
+        run(interval_ms);
+      });
+  }
+
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cond.notify_all();
+    if (watcher.joinable())
+      watcher.join();
+  }
+
+  void report(const char* name) const
+  {
+    printf("    >>> %s reload: generation %d, %d reloads, %d failed\n", name, (int)generations, (int)reloads, (int)failures);
+  }
+
+protected:
+  typedef struct Stamp
+  {
+    long long mtime_ns = -1;
+    long long size = -1;
+    bool operator==(const Stamp& other) const { return mtime_ns == other.mtime_ns && size == other.size; }
+    bool operator!=(const Stamp& other) const { return !(*this == other); }
+  } Stamp;
+
+  bool stamp(Stamp& result) const
+  {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+      return false;
+    result.mtime_ns = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    result.size = (long long)st.st_size;
+    return true;
+  }
+
+  void run(int interval_ms)
+  {
+    Stamp previous = loaded_stamp, failed;
+    while (true)
+    {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (cond.wait_for(lock, std::chrono::milliseconds(interval_ms), [this]() { return stopping; }))
+          return;
+      }
+
+      // a file still being copied changes between polls, it is loaded once it holds still
+      Stamp now;
+      if (!stamp(now) || now == loaded_stamp || now == failed)
+        continue;
+      if (now != previous)
+      {
+        previous = now;
+        continue;
+      }
+
+      auto start = std::chrono::high_resolution_clock::now();
+      printf("(i)----%s changed, loading it in the background\n", path.c_str());
+      std::shared_ptr<T> loaded = loader();
+      if (!loaded)
+      {
+        fprintf(stderr, "(!)----Error: cannot reload %s, generation %d keeps running.\n", path.c_str(), (int)generations);
+        failed = now;
+        failures++;
+        continue;
+      }
+      // locked before it serves, pages of the old version are unlocked as they are freed
+      if (realtime)
+        qg_lock_memory();
+      std::atomic_store(&current, loaded);
+      loaded_stamp = now;
+      generations++;
+      reloads++;
+      printf("(i)----%s reloaded and warmed in %f ms, generation %d serves new requests\n", path.c_str(),
+        std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count(), (int)generations);
+    }
+  }
+
+private:
+  std::string path;
+  Loader loader;
+  bool realtime = false;
+  std::shared_ptr<T> current;
+  Stamp loaded_stamp;
+  std::atomic<int> generations{ 0 };
+  std::atomic<int> reloads{ 0 };
+  std::atomic<int> failures{ 0 };
+
+  std::thread watcher;
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool stopping = false;
+};
+
+#endif //RELOAD_H
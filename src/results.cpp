@@ -0,0 +1,384 @@
+#include "results.h"
+#include "hash.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <map>
+
+static const char RESULTS_MAGIC[4] = { 'Q', 'G', 'R', 'B' };
+static const uint32_t RESULTS_VERSION = 1;
+
+void QGResults::append_escaped(std::string& out, const std::string& text, bool json)
+{
+  out += '"';
+  for (char c : text)
+  {
+    if (c == '"')
+      out += json ? "\\\"" : "\"\"";
+    else if (json && c == '\\')
+      out += "\\\\";
+    else if (json && (unsigned char)c < 0x20)
+      out += cv::format("\\u%04x", c);
+    else
+      out += c;
+  }
+  out += '"';
+}
+
+QGResults::QGResults(const std::vector<std::string>& detect_labels, const std::vector<std::string>& classify_labels)
+  : detect_labels(detect_labels), classify_labels(classify_labels)
+{
+}
+
+QGResults::~QGResults()
+{
+  close();
+}
+
+bool QGResults::parse_format(const std::string& text, Format& format)
+{
+  if (text == "jsonl") format = JSONL;
+  else if (text == "csv") format = CSV;
+  else if (text == "bin") format = BINARY;
+  else return false;
+  return true;
+}
+
+int QGResults::open(const Params& params)
+{
+  close();
+  this->params = params;
+  file = fopen(params.path.c_str(), params.append ? "a+b" : "wb");
+  if (!file)
+  {
+    fprintf(stderr, "(!)----Error: cannot open results %s.\n", params.path.c_str());
+    return 0;
+  }
+
+  // an appended file keeps its header, a binary one must be of this version
+  fseek(file, 0, SEEK_END);
+  if (ftell(file) > 0)
+  {
+    char magic[4];
+    uint32_t version = 0;
+    rewind(file);
+    if (params.format == BINARY && (fread(magic, 1, 4, file) != 4 || memcmp(magic, RESULTS_MAGIC, 4) != 0
+      || fread(&version, sizeof(version), 1, file) != 1 || version != RESULTS_VERSION))
+    {
+      fprintf(stderr, "(!)----Error: %s is not a results file of this version, cannot append to it.\n", params.path.c_str());
+      close();
+      return 0;
+    }
+    fseek(file, 0, SEEK_END);
+    return 1;
+  }
+
+  if (params.format == BINARY)
+  {
+    fwrite(RESULTS_MAGIC, 1, 4, file);
+    fwrite(&RESULTS_VERSION, sizeof(RESULTS_VERSION), 1, file);
+  }
+  else if (params.format == CSV)
+    fprintf(file, "lot,name,label,score,skipped,cached,top_k,u_boxes,d_boxes,decode_ms,detect_ms,classify_ms,total_ms\n");
+  return 1;
+}
+
+void QGResults::close()
+{
+  if (file)
+    fclose(file);
+  file = nullptr;
+}
+
+void QGResults::write(const std::string& lot, const std::string& name, const GradeInfo& info, const Timings& timings, bool cached)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (!file)
+    return;
+  if (params.format == JSONL)
+    write_jsonl(lot, name, info, timings, cached);
+  else if (params.format == CSV)
+    write_csv(lot, name, info, timings, cached);
+  else
+    write_binary(lot, name, info, timings, cached);
+  // a resumed run skips what the manifests hold, the record is out before the manifest line
+  if (params.append)
+    fflush(file);
+}
+
+void QGResults::write_jsonl(const std::string& lot, const std::string& name, const GradeInfo& info, const Timings& timings, bool cached)
+{
+  line.clear();
+  line += "{\"lot\":";
+  append_escaped(line, lot, true);
+  line += ",\"name\":";
+  append_escaped(line, name, true);
+  line += ",\"label\":";
+  append_escaped(line, info.cinfos.empty() ? "NONE" : classify_labels[info.cinfos[0].labelid], true);
+  line += cv::format(",\"skipped\":%s,\"cached\":%s", info.skipped ? "true" : "false", cached ? "true" : "false");
+
+  int top_k = std::min((int)info.cinfos.size(), params.top_k);
+  line += ",\"top_k\":[";
+  for (int i = 0; i < top_k; i++)
+  {
+    line += cv::format("%s{\"id\":%d,\"label\":", i ? "," : "", info.cinfos[i].labelid);
+    append_escaped(line, classify_labels[info.cinfos[i].labelid], true);
+    line += cv::format(",\"score\":%.5f}", info.cinfos[i].score);
+  }
+  line += "]";
+
+  const char* keys[2] = { "u_boxes", "d_boxes" };
+  const std::vector<BoxInfo>* views[2] = { &info.udinfos, &info.ddinfos };
+  for (int v = 0; v < 2; v++)
+  {
+    line += cv::format(",\"%s\":[", keys[v]);
+    for (size_t i = 0; i < views[v]->size(); i++)
+    {
+      const BoxInfo& box = (*views[v])[i];
+      line += cv::format("%s{\"box\":[%d,%d,%d,%d],\"id\":%d,\"label\":", i ? "," : "",
+        box.bbox.x, box.bbox.y, box.bbox.width, box.bbox.height, box.labelid);
+      append_escaped(line, detect_labels[box.labelid], true);
+      line += cv::format(",\"score\":%.5f}", box.score);
+    }
+    line += "]";
+  }
+
+  line += cv::format(",\"ms\":{\"decode\":%.3f,\"detect\":%.3f,\"classify\":%.3f,\"total\":%.3f}}\n",
+    timings.decode_ms, timings.detect_ms, timings.classify_ms, timings.total_ms);
+  fwrite(line.data(), 1, line.size(), file);
+}
+
+void QGResults::write_csv(const std::string& lot, const std::string& name, const GradeInfo& info, const Timings& timings, bool cached)
+{
+  // lists are packed in one field each: "id:score;..." and "x y w h id score;..."
+  line.clear();
+  append_escaped(line, lot, false);
+  line += ",";
+  append_escaped(line, name, false);
+  line += ",";
+  append_escaped(line, info.cinfos.empty() ? "NONE" : classify_labels[info.cinfos[0].labelid], false);
+  line += cv::format(",%.5f,%d,%d,", info.cinfos.empty() ? 0.0f : info.cinfos[0].score, info.skipped ? 1 : 0, cached ? 1 : 0);
+
+  int top_k = std::min((int)info.cinfos.size(), params.top_k);
+  for (int i = 0; i < top_k; i++)
+    line += cv::format("%s%d:%.5f", i ? ";" : "", info.cinfos[i].labelid, info.cinfos[i].score);
+  for (const auto* dinfos : { &info.udinfos, &info.ddinfos })
+  {
+    line += ",";
+    for (size_t i = 0; i < dinfos->size(); i++)
+    {
+      const BoxInfo& box = (*dinfos)[i];
+      line += cv::format("%s%d %d %d %d %d %.5f", i ? ";" : "", box.bbox.x, box.bbox.y, box.bbox.width, box.bbox.height, box.labelid, box.score);
+    }
+  }
+  line += cv::format(",%.3f,%.3f,%.3f,%.3f\n", timings.decode_ms, timings.detect_ms, timings.classify_ms, timings.total_ms);
+  fwrite(line.data(), 1, line.size(), file);
+}
+
+void QGResults::write_binary(const std::string& lot, const std::string& name, const GradeInfo& info, const Timings& timings, bool cached)
+{
+  auto put = [this](const void* data, size_t size) { line.append((const char*)data, size); };
+  auto put_u16 = [&](size_t value) { uint16_t v = (uint16_t)std::min(value, (size_t)UINT16_MAX); put(&v, sizeof(v)); };
+
+  line.assign(4, '\0');
+  put_u16(lot.size());
+  put(lot.data(), std::min(lot.size(), (size_t)UINT16_MAX));
+  put_u16(name.size());
+  put(name.data(), std::min(name.size(), (size_t)UINT16_MAX));
+  put_u16(info.udinfos.size());
+  put_u16(info.ddinfos.size());
+  int top_k = std::min((int)info.cinfos.size(), params.top_k);
+  put_u16(top_k);
+  uint8_t flags = (info.skipped ? 1 : 0) | (cached ? 2 : 0);
+  put(&flags, 1);
+  for (const auto* dinfos : { &info.udinfos, &info.ddinfos })
+  {
+    for (const auto& box : *dinfos)
+    {
+      int32_t values[5] = { box.bbox.x, box.bbox.y, box.bbox.width, box.bbox.height, box.labelid };
+      put(values, sizeof(values));
+      put(&box.score, sizeof(float));
+    }
+  }
+  for (int i = 0; i < top_k; i++)
+  {
+    int32_t labelid = info.cinfos[i].labelid;
+    put(&labelid, sizeof(labelid));
+    put(&info.cinfos[i].score, sizeof(float));
+  }
+  float ms[4] = { (float)timings.decode_ms, (float)timings.detect_ms, (float)timings.classify_ms, (float)timings.total_ms };
+  put(ms, sizeof(ms));
+
+  uint32_t size = line.size() - 4;
+  memcpy(&line[0], &size, 4);
+  fwrite(line.data(), 1, line.size(), file);
+}
+
+bool QGResults::parse_shard(const std::string& text, int& index, int& count)
+{
+  return sscanf(text.c_str(), "%d/%d", &index, &count) == 2 && count > 0 && index >= 0 && index < count;
+}
+
+int QGResults::shard(const std::string& lot, const std::string& name, int count)
+{
+  return qg_hash64(lot + "/" + name) % count;
+}
+
+std::string QGResults::shard_path(const std::string& path, int index, int count)
+{
+  return count > 1 ? path + cv::format(".%d-of-%d", index, count) : path;
+}
+
+// reads a quoted field at pos, json or csv escaped, and moves pos past it.
+static bool read_quoted(const std::string& text, size_t& pos, std::string& value, bool json)
+{
+  value.clear();
+  if (pos >= text.size() || text[pos] != '"')
+    return false;
+  for (pos++; pos < text.size(); pos++)
+  {
+    char c = text[pos];
+    if (c == '"')
+    {
+      if (!json && pos + 1 < text.size() && text[pos + 1] == '"')
+      {
+        value += '"';
+        pos++;
+        continue;
+      }
+      pos++;
+      return true;
+    }
+    if (json && c == '\\' && pos + 1 < text.size())
+    {
+      c = text[++pos];
+      if (c == 'u' && pos + 4 < text.size())
+      {
+        value += (char)strtol(text.substr(pos + 1, 4).c_str(), nullptr, 16);
+        pos += 4;
+        continue;
+      }
+    }
+    value += c;
+  }
+  return false;
+}
+
+int QGResults::merge(const std::vector<std::string>& inputs, const std::string& output, Format format)
+{
+  // records are kept verbatim, keyed by lot and name
+  std::map<std::pair<std::string, std::string>, std::string> records;
+  std::string header;
+  int duplicates = 0;
+  for (const auto& input : inputs)
+  {
+    FILE* file = fopen(input.c_str(), "rb");
+    if (!file)
+    {
+      fprintf(stderr, "(!)----Error: cannot open results %s.\n", input.c_str());
+      return -1;
+    }
+    std::string content;
+    char buffer[1 << 16];
+    for (size_t n; (n = fread(buffer, 1, sizeof(buffer), file)) > 0; )
+      content.append(buffer, n);
+    fclose(file);
+
+    size_t pos = 0;
+    bool valid = true;
+    if (format == BINARY)
+    {
+      uint32_t version = 0;
+      valid = content.size() >= 8 && !memcmp(content.data(), RESULTS_MAGIC, 4);
+      if (valid)
+        memcpy(&version, content.data() + 4, 4);
+      valid = valid && version == RESULTS_VERSION;
+      header = content.substr(0, 8);
+      pos = 8;
+    }
+    else if (format == CSV)
+    {
+      pos = content.find('\n');
+      valid = pos != std::string::npos;
+      header = content.substr(0, pos + 1);
+      pos++;
+    }
+
+    while (valid && pos < content.size())
+    {
+      std::string lot, name, record;
+      if (format == BINARY)
+      {
+        uint32_t size = 0;
+        uint16_t length = 0;
+        valid = pos + 6 <= content.size();
+        if (!valid) break;
+        memcpy(&size, content.data() + pos, 4);
+        valid = pos + 4 + size <= content.size();
+        if (!valid) break;
+        record = content.substr(pos, 4 + size);
+        pos += 4 + size;
+        // lot and name lengths must stay within the record
+        size_t field = 4;
+        valid = field + 2 <= record.size();
+        if (!valid) break;
+        memcpy(&length, record.data() + field, 2);
+        valid = field + 2 + length + 2 <= record.size();
+        if (!valid) break;
+        lot = record.substr(field + 2, length);
+        field += 2 + length;
+        memcpy(&length, record.data() + field, 2);
+        valid = field + 2 + length <= record.size();
+        if (!valid) break;
+        name = record.substr(field + 2, length);
+      }
+      else
+      {
+        size_t end = content.find('\n', pos);
+        valid = end != std::string::npos;
+        if (!valid) break;
+        record = content.substr(pos, end + 1 - pos);
+        size_t field = 0;
+        if (format == JSONL)
+        {
+          field = strlen("{\"lot\":");
+          valid = !record.compare(0, field, "{\"lot\":") && read_quoted(record, field, lot, true) && !record.compare(field, strlen(",\"name\":"), ",\"name\":");
+          field += strlen(",\"name\":");
+          valid = valid && read_quoted(record, field, name, true);
+        }
+        else
+          valid = read_quoted(record, field, lot, false) && record[field++] == ',' && read_quoted(record, field, name, false);
+        pos = end + 1;
+      }
+      if (!valid) break;
+      // appended files hold a regraded pair after its earlier record, the last one is kept
+      auto placed = records.emplace(std::make_pair(lot, name), record);
+      if (!placed.second)
+      {
+        placed.first->second = record;
+        duplicates++;
+      }
+    }
+    if (!valid)
+    {
+      fprintf(stderr, "(!)----Error: %s is not a complete %s results file.\n", input.c_str(),
+        format == JSONL ? "jsonl" : format == CSV ? "csv" : "bin");
+      return -1;
+    }
+  }
+
+  FILE* file = fopen(output.c_str(), "wb");
+  if (!file)
+  {
+    fprintf(stderr, "(!)----Error: cannot open results %s.\n", output.c_str());
+    return -1;
+  }
+  fwrite(header.data(), 1, header.size(), file);
+  for (const auto& record : records)
+    fwrite(record.second.data(), 1, record.second.size(), file);
+  fclose(file);
+
+  printf("    >>> merged %d records of %d files into %s, %d duplicates dropped\n",
+    (int)records.size(), (int)inputs.size(), output.c_str(), duplicates);
+  return 0;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "grader.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <mutex>
+
+// Per pair grading records for downstream tools, one record per line in JSONL or CSV, or
+// length prefixed records in a compact binary file:
+//   header: "QGRB", u32 version
+//   record: u32 size of the rest, u16 lot length, lot, u16 name length, name,
+//           u16 U boxes, u16 D boxes, u16 top k classes, u8 flags (1 skipped, 2 cached),
+//           boxes as i32 x, y, width, height, label, f32 score, classes as i32 label, f32 score,
+//           f32 decode, detect, classify and total milliseconds
+// all little endian, boxes are in aligned view coordinates.
+class QGResults
+{
+public:
+  enum Format { JSONL, CSV, BINARY };
+
+  typedef struct Params
+  {
+    std::string path;
+    Format format = JSONL;
+    int top_k = 3;  /* classifier labels kept per pair */
+    bool append = false;  /* incremental runs add their records to those of earlier runs */
+    Params() {}
+  } Params;
+
+  typedef struct Timings
+  {
+    double decode_ms = 0;
+    double detect_ms = 0;
+    double classify_ms = 0;
+    double total_ms = 0;
+  } Timings;
+
+public:
+  QGResults(const std::vector<std::string>& detect_labels, const std::vector<std::string>& classify_labels);
+  ~QGResults();
+  int open(const Params& params);
+  void close();
+  bool opened() const { return file != nullptr; }
+
+  // jsonl, csv or bin.
+  static bool parse_format(const std::string& text, Format& format);
+  // may be called from several threads, records are written whole in call order, and flushed
+  // when appending so that they reach the file before the manifest marks the pair done.
+  void write(const std::string& lot, const std::string& name, const GradeInfo& info, const Timings& timings, bool cached);
+
+  // sharding: a pair belongs to one of count shards by a hash of its lot and name,
+  // the same on every run and machine, so that shards can be graded by separate processes.
+  static bool parse_shard(const std::string& text, int& index, int& count);
+  static int shard(const std::string& lot, const std::string& name, int count);
+  static std::string shard_path(const std::string& path, int index, int count);
+  // combines result files of one format into one ordered by lot and name.
+  static int merge(const std::vector<std::string>& inputs, const std::string& output, Format format);
+  // text as a quoted field, json or csv escaped.
+  static void append_escaped(std::string& out, const std::string& text, bool json);
+
+protected:
+  void write_jsonl(const std::string& lot, const std::string& name, const GradeInfo& info, const Timings& timings, bool cached);
+  void write_csv(const std::string& lot, const std::string& name, const GradeInfo& info, const Timings& timings, bool cached);
+  void write_binary(const std::string& lot, const std::string& name, const GradeInfo& info, const Timings& timings, bool cached);
+
+private:
+  const std::vector<std::string>& detect_labels;
+  const std::vector<std::string>& classify_labels;
+  Params params;
+  FILE* file = nullptr;
+  std::string line;
+  std::mutex lock;
+};
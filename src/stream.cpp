@@ -0,0 +1,177 @@
+#include "stream.h"
+#include "realtime.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+extern const char* APP_WINDOW_NAME;
+
+QGStream::QGStream(QGReloader<QGDetector>& detectors, QGReloader<QGClassifier>& classifiers,
+  const std::vector<std::string>& detect_labels, const std::vector<std::string>& classify_labels, const Params& params)
+  : detectors(detectors), classifiers(classifiers), detect_labels(detect_labels), classify_labels(classify_labels), params(params)
+{
+}
+
+int QGStream::run(cv::VideoCapture& capture, bool display)
+{
+  if (!capture.isOpened())
+  {
+    fprintf(stderr, "(!)----Error: capture is not opened, please check!\n");
+    return -1;
+  }
+
+  int buffers = std::max(1, detectors.get()->buffers());
+  std::vector<cv::Mat> frames(buffers);
+  std::vector<std::shared_ptr<QGDetector>> owners(buffers);  /* detector a buffer was prepared on */
+  std::vector<std::chrono::high_resolution_clock::time_point> captured(buffers);
+  std::queue<int> free_buffers, ready_buffers;
+  for (int i = 0; i < buffers; i++)
+    free_buffers.push(i);
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool finished = false, stop = false;
+
+  // capture and preprocess run ahead of inference into the free buffers
+  std::thread producer([&]()
+    {
+      if (!params.capture_cpus.empty() || params.priority > 0)
+        qg_realtime_thread("capture", params.capture_cpus, params.priority);
+      while (true)
+      {
+        int buffer;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          cond.wait(lock, [&]() { return stop || !free_buffers.empty(); });
+          if (stop) break;
+          buffer = free_buffers.front();
+          free_buffers.pop();
+        }
+
+        // latency runs from the frame handed over by the capture, not from the wait for it
+        owners[buffer] = detectors.get();
+        bool ok = capture.read(frames[buffer]) && !frames[buffer].empty();
+        captured[buffer] = std::chrono::high_resolution_clock::now();
+        ok = ok && owners[buffer]->prepare(frames[buffer], buffer);
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (ok)
+            ready_buffers.push(buffer);
+          else
+            finished = true;
+        }
+        cond.notify_all();
+        if (!ok) break;
+      }
+    });
+
+  int count = 0;
+  double inference = 0;
+  int report_frames = std::max(1, params.report_frames);
+  std::vector<double> window;
+  window.reserve(report_frames);
+  auto t0 = std::chrono::high_resolution_clock::now();
+  while (true)
+  {
+    int buffer;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cond.wait(lock, [&]() { return finished || !ready_buffers.empty(); });
+      if (ready_buffers.empty()) break;
+      buffer = ready_buffers.front();
+      ready_buffers.pop();
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    grade(*owners[buffer], frames[buffer], buffer, display);
+    auto end = std::chrono::high_resolution_clock::now();
+    inference += std::chrono::duration<double, std::milli>(end - start).count();
+    window.push_back(std::chrono::duration<double, std::milli>(end - captured[buffer]).count());
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      free_buffers.push(buffer);
+    }
+    cond.notify_all();
+
+    if (++count % report_frames == 0)
+    {
+      double elapsed = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+      printf("    >>> stream: %d frames, %d buffers, throughput: %.1f fps, inference bound: %.1f fps\n",
+        count, buffers, 1000.0 * count / elapsed, 1000.0 * count / inference);
+      report_latency(window, false);
+    }
+    if (display && cv::waitKey(1) == 27)
+      break;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  cond.notify_all();
+  producer.join();
+  report_latency(window, true);
+  return 0;
+}
+
+void QGStream::report_latency(std::vector<double>& window, bool final)
+{
+  // latency runs from the capture of a frame to its grade, queueing behind inference included
+  if (!window.empty())
+  {
+    for (double latency : window)
+    {
+      frames++;
+      latency_sum += latency;
+      latency_squares += latency * latency;
+      latency_max = std::max(latency_max, latency);
+    }
+    std::sort(window.begin(), window.end());
+    auto percentile = [&](double p) { return window[std::min(window.size() - 1, (size_t)(p * window.size()))]; };
+    printf("    >>> latency of the last %d frames: p50: %f ms, p99: %f ms, max: %f ms, jitter (p99 - p50): %f ms\n",
+      (int)window.size(), percentile(0.5), percentile(0.99), window.back(), percentile(0.99) - percentile(0.5));
+    window.clear();
+  }
+  if (final && frames > 0)
+  {
+    double mean = latency_sum / frames;
+    printf("    >>> latency over %d frames: mean: %f ms, stddev: %f ms, max: %f ms\n",
+      frames, mean, std::sqrt(std::max(0.0, latency_squares / frames - mean * mean)), latency_max);
+  }
+}
+
+void QGStream::grade(QGDetector& detector, cv::Mat& frame, int buffer, bool display)
+{
+  std::shared_ptr<QGClassifier> classifier = classifiers.get();
+  detector.run(buffer, dinfos);
+  if (dinfos.empty())
+  {
+    if (display) cv::imshow(APP_WINDOW_NAME, frame);
+    return;
+  }
+
+  cv::Rect box;
+  for (const auto& info : dinfos)
+    box |= info.bbox;
+  box &= cv::Rect(0, 0, frame.cols, frame.rows);
+  classifier->classify(frame(box), cinfos);
+
+  if (display)
+  {
+    cv::Scalar crDetect(0, 0, 255);
+    for (const auto& info : dinfos)
+    {
+      cv::rectangle(frame, info.bbox, crDetect);
+      cv::putText(frame, detect_labels[info.labelid], info.bbox.tl(), cv::FONT_HERSHEY_SIMPLEX, 0.5, crDetect, 1);
+    }
+    if (!cinfos.empty())
+      cv::putText(frame, classify_labels[cinfos[0].labelid], cv::Point(30, 60), cv::FONT_HERSHEY_SIMPLEX, 1, crDetect, 2);
+    cv::imshow(APP_WINDOW_NAME, frame);
+  }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "detector.h"
+#include "classifier.h"
+#include "reload.hpp"
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/videoio.hpp>
+
+class QGStream
+{
+public:
+  typedef struct Params
+  {
+    // real-time mode: the capture and preprocess thread pinned to capture_cpus, and SCHED_FIFO
+    // for it when priority is 1 to 99. the calling thread is set up by the caller, see realtime.hpp.
+    std::vector<int> capture_cpus;
+    int priority = 0;
+    int report_frames = 100;  /* frames per throughput and latency line */
+    Params() {}
+  } Params;
+
+public:
+  // the models in use are taken from the reloaders frame by frame, a frame is prepared and
+  // inferred on the same detector even when a reload switches models in between.
+  QGStream(QGReloader<QGDetector>& detectors, QGReloader<QGClassifier>& classifiers,
+    const std::vector<std::string>& detect_labels, const std::vector<std::string>& classify_labels,
+    const Params& params = Params());
+
+  // grades frames until the capture ends or ESC is pressed in the window.
+  // frame N+1 is captured and preprocessed on its own thread while frame N is inferred,
+  // as far as the detector has input buffers for.
+  int run(cv::VideoCapture& capture, bool display);
+
+private:
+  void grade(QGDetector& detector, cv::Mat& frame, int buffer, bool display);
+  // percentiles and spread of the capture to grade latencies of the last frames, and over the whole run.
+  void report_latency(std::vector<double>& window, bool final);
+
+  QGReloader<QGDetector>& detectors;
+  QGReloader<QGClassifier>& classifiers;
+  const std::vector<std::string>& detect_labels;
+  const std::vector<std::string>& classify_labels;
+  Params params;
+
+  int frames = 0;
+  double latency_sum = 0, latency_squares = 0, latency_max = 0;
+
+  std::vector<BoxInfo> dinfos;
+  std::vector<ClassInfo> cinfos;
+};
@@ -0,0 +1,203 @@
+#include "tensorcache.h"
+#include "hash.hpp"
+#include "grader.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char TENSOR_CACHE_MAGIC[4] = { 'Q', 'G', 'T', 'C' };
+static const uint32_t TENSOR_CACHE_VERSION = 2;
+static const size_t TENSOR_CACHE_ALIGN = 4096;
+
+QGTensorCache::~QGTensorCache()
+{
+  if (header)
+    munmap(header, mapped_bytes);
+  if (fd >= 0)
+    close(fd);
+}
+
+int QGTensorCache::init(const Params& params, uint64_t config)
+{
+  this->params = params;
+  this->config = config;
+
+  fd = open(params.path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+  {
+    fprintf(stderr, "(!)----Error: cannot open tensor cache %s.\n", params.path.c_str());
+    return 0;
+  }
+
+  // an existing cache keeps its size, the size limit applies when it is created
+  Header existing = {};
+  struct stat st;
+  bool valid = fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Header)
+    && pread(fd, &existing, sizeof(Header), 0) == (ssize_t)sizeof(Header)
+    && !memcmp(existing.magic, TENSOR_CACHE_MAGIC, 4) && existing.version == TENSOR_CACHE_VERSION
+    && existing.planar == (params.planar ? 1u : 0u) && existing.detector_bytes == params.detector_bytes
+    && existing.classifier_bytes == params.classifier_bytes
+    && existing.data_offset >= sizeof(Header) + existing.capacity * sizeof(Slot)
+    && existing.data_offset + existing.used <= (uint64_t)st.st_size;
+
+  // slots for as many pairs as the data region could hold without classifier inputs
+  uint64_t capacity = valid ? existing.capacity : params.max_bytes / block_bytes(true, false);
+  uint64_t data_offset = valid ? existing.data_offset
+    : (sizeof(Header) + capacity * sizeof(Slot) + TENSOR_CACHE_ALIGN - 1) / TENSOR_CACHE_ALIGN * TENSOR_CACHE_ALIGN;
+  mapped_bytes = valid ? st.st_size : params.max_bytes;
+  if (capacity == 0 || data_offset + block_bytes(true, true) > mapped_bytes)
+  {
+    fprintf(stderr, "(!)----Error: tensor cache size %zu bytes holds no pair.\n", params.max_bytes);
+    return 0;
+  }
+
+  // the file is sparse, pages of the data region are allocated as inputs are written
+  if (!valid && (ftruncate(fd, 0) != 0 || ftruncate(fd, mapped_bytes) != 0))
+  {
+    fprintf(stderr, "(!)----Error: cannot size tensor cache %s.\n", params.path.c_str());
+    return 0;
+  }
+  void* mapped = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED)
+  {
+    fprintf(stderr, "(!)----Error: cannot map tensor cache %s.\n", params.path.c_str());
+    return 0;
+  }
+  header = (Header*)mapped;
+  slots = (Slot*)(header + 1);
+  data = (unsigned char*)mapped + data_offset;
+  if (!valid)
+  {
+    // ftruncate zero filled the table, every slot is free
+    memcpy(header->magic, TENSOR_CACHE_MAGIC, 4);
+    header->version = TENSOR_CACHE_VERSION;
+    header->planar = params.planar ? 1 : 0;
+    header->detector_bytes = params.detector_bytes;
+    header->classifier_bytes = params.classifier_bytes;
+    header->capacity = capacity;
+    header->count = 0;
+    header->data_offset = data_offset;
+    header->used = 0;
+  }
+  printf("(i)----tensor cache %s: %llu pairs, %.1f of %.1f MB used\n", params.path.c_str(), (unsigned long long)header->count,
+    (double)header->used / (1 << 20), (double)(mapped_bytes - data_offset) / (1 << 20));
+  return 1;
+}
+
+std::string QGTensorCache::settings(const cv::Size& detector_size, const cv::Size& classifier_size, bool planar, bool reduced, bool cropped)
+{
+  std::string text = cv::format("align %f %d %d\n", UD_SCALE, UD_TRANS[0], UD_TRANS[1]);
+  text += cv::format("inputs %dx%d %dx%d %s\n", detector_size.width, detector_size.height,
+    classifier_size.width, classifier_size.height, planar ? "f32" : "u8");
+  return text + cv::format("decode %d %d\n", reduced ? 1 : 0, cropped ? 1 : 0);
+}
+
+uint64_t QGTensorCache::key(const std::vector<unsigned char>& bytesU, const std::vector<unsigned char>& bytesD) const
+{
+  uint64_t key = qg_hash64(bytesD.data(), bytesD.size(), qg_hash64(bytesU.data(), bytesU.size(), config));
+  return key ? key : 1;
+}
+
+size_t QGTensorCache::block_bytes(bool detector, bool classifier) const
+{
+  size_t bytes = (detector ? 2 * params.detector_bytes : 0) + (classifier ? params.classifier_bytes : 0);
+  return (bytes + 63) / 64 * 64;
+}
+
+QGTensorCache::Slot* QGTensorCache::find(uint64_t key) const
+{
+  // linear probing, the table is never filled beyond three quarters
+  uint64_t capacity = header->capacity;
+  for (uint64_t slot = key % capacity; ; slot = (slot + 1) % capacity)
+  {
+    Slot* candidate = slots + slot;
+    if (candidate->key == key || candidate->key == 0)
+      return candidate;
+  }
+}
+
+bool QGTensorCache::lookup(uint64_t key, uint64_t tag, Entry& entry)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  const Slot* slot = find(key);
+  if (slot->key != key)
+  {
+    counts.misses++;
+    return false;
+  }
+
+  entry.sizeU = cv::Size(slot->sizeU[0], slot->sizeU[1]);
+  entry.sizeD = cv::Size(slot->sizeD[0], slot->sizeD[1]);
+  entry.scale = slot->scale;
+  entry.inputU = data + slot->offset;
+  entry.inputD = entry.inputU + params.detector_bytes;
+  entry.inputC = slot->classified && slot->tag == tag ? data + slot->offsetC : nullptr;
+  entry.stale = slot->classified && !entry.inputC;
+  if (entry.stale)
+    counts.partial++;
+  else
+    counts.hits++;
+  return true;
+}
+
+bool QGTensorCache::reserve(bool detector, bool classifier, Entry& entry)
+{
+  // data is only appended, inputs handed out by lookup() are never overwritten
+  std::lock_guard<std::mutex> guard(lock);
+  size_t bytes = block_bytes(detector, classifier);
+  if (header->data_offset + header->used + bytes > mapped_bytes || (detector && (header->count + 1) * 4 > header->capacity * 3))
+  {
+    counts.dropped++;
+    return false;
+  }
+  unsigned char* block = data + header->used;
+  if (detector)
+  {
+    entry.inputU = block;
+    entry.inputD = entry.inputU + params.detector_bytes;
+    block += 2 * params.detector_bytes;
+  }
+  entry.inputC = classifier ? block : nullptr;
+  header->used += bytes;
+  return true;
+}
+
+void QGTensorCache::commit(uint64_t key, uint64_t tag, const Entry& entry)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  Slot* slot = find(key);
+  bool fresh = slot->key != key;
+  Slot staged = {};
+  staged.offset = entry.inputU - data;
+  staged.offsetC = entry.inputC ? entry.inputC - data : 0;
+  staged.tag = tag;
+  staged.sizeU[0] = entry.sizeU.width;
+  staged.sizeU[1] = entry.sizeU.height;
+  staged.sizeD[0] = entry.sizeD.width;
+  staged.sizeD[1] = entry.sizeD.height;
+  staged.scale = entry.scale;
+  staged.classified = entry.inputC ? 1 : 0;
+
+  // the key goes in last, a run killed halfway leaves a free slot rather than a torn one
+  if (!fresh)
+    __atomic_store_n(&slot->key, 0, __ATOMIC_RELEASE);
+  *slot = staged;
+  __atomic_store_n(&slot->key, key, __ATOMIC_RELEASE);
+  if (fresh)
+    header->count++;
+  counts.stored++;
+}
+
+void QGTensorCache::report() const
+{
+  if (!header)
+    return;
+
+  int lookups = counts.hits + counts.partial + counts.misses;
+  printf("    >>> tensor cache (%s): %d hits, %d without classifier input, %d misses, hit rate %.1f%%, %d stored, %d not stored, %llu pairs, %.1f MB used\n",
+    params.planar ? "f32" : "u8", counts.hits, counts.partial, counts.misses,
+    lookups ? 100.0 * (counts.hits + counts.partial) / lookups : 0.0, counts.stored, counts.dropped,
+    (unsigned long long)header->count, (double)header->used / (1 << 20));
+}
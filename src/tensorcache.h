@@ -0,0 +1,113 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+
+// Persistent preprocessed network inputs keyed on the contents of both views and on the
+// preprocessing configuration. The file is a header, an open addressed table of slots and an
+// append only data region, mapped as a whole, so a rerun with another model version feeds the
+// input tensors from the mapping instead of decoding, aligning and resizing the views again.
+// Inputs are the resized bgr images (u8) or the planar float tensors (f32) of QGDetector and
+// QGClassifier. The classifier input depends on the detections, it carries a tag of the detector
+// model and settings and is used only when the tag matches. It has a block of its own, a pair
+// classified again under another tag gets a new classifier input next to its detector inputs.
+class QGTensorCache
+{
+public:
+  typedef struct Params
+  {
+    std::string path;
+    size_t max_bytes = 4096ull << 20;  /* file size when the cache is created, the file is sparse */
+    bool planar = false;               /* f32 tensors rather than u8 images */
+    size_t detector_bytes = 0;         /* one view, QGDetector::input_bytes() */
+    size_t classifier_bytes = 0;       /* QGClassifier::input_bytes() */
+    Params() {}
+  } Params;
+
+  typedef struct Stats
+  {
+    int hits = 0;
+    int partial = 0;  /* detector inputs found, classifier input missing or of another detector */
+    int misses = 0;
+    int stored = 0;
+    int dropped = 0;  /* the table or the data region is full */
+  } Stats;
+
+  // inputs point into the mapping, they stay valid as long as the cache
+  typedef struct Entry
+  {
+    cv::Size sizeU, sizeD;  /* frame sizes the detector inputs were resized from */
+    int scale = 1;          /* reduction of the decoded views */
+    unsigned char* inputU = nullptr;
+    unsigned char* inputD = nullptr;
+    unsigned char* inputC = nullptr;  /* null when the pair was not classified */
+    bool stale = false;  /* classified under another tag, inputC is left out */
+  } Entry;
+
+protected:
+  typedef struct Header
+  {
+    char magic[4];
+    uint32_t version;
+    uint32_t planar;
+    uint32_t reserved;
+    uint64_t detector_bytes;
+    uint64_t classifier_bytes;
+    uint64_t capacity;  /* slots */
+    uint64_t count;
+    uint64_t data_offset;
+    uint64_t used;      /* bytes of the data region handed out */
+  } Header;
+
+  typedef struct Slot
+  {
+    uint64_t key;  /* 0 marks a free slot */
+    uint64_t offset;  /* U and D inputs */
+    uint64_t offsetC;  /* classifier input when classified */
+    uint64_t tag;
+    int32_t sizeU[2], sizeD[2];
+    int32_t scale;
+    int32_t classified;
+  } Slot;
+
+public:
+  ~QGTensorCache();
+  // maps the cache file, creating it when missing or written with other input sizes or format.
+  // config is folded into every key, see key().
+  int init(const Params& params, uint64_t config);
+
+  // every option that changes the inputs, as text.
+  static std::string settings(const cv::Size& detector_size, const cv::Size& classifier_size, bool planar, bool reduced, bool cropped);
+  uint64_t key(const std::vector<unsigned char>& bytesU, const std::vector<unsigned char>& bytesD) const;
+
+  // lookup(), reserve() and commit() may be called from several threads.
+  // a classifier input of another tag is left out of the entry.
+  bool lookup(uint64_t key, uint64_t tag, Entry& entry);
+  // hands out room for the detector inputs of one pair, its classifier input or both, filled by
+  // the caller then committed. inputs not asked for are left as they are in the entry.
+  bool reserve(bool detector, bool classifier, Entry& entry);
+  void commit(uint64_t key, uint64_t tag, const Entry& entry);
+
+  bool planar() const { return params.planar; }
+  const Stats& stats() const { return counts; }
+  void report() const;
+
+protected:
+  Slot* find(uint64_t key) const;
+  size_t block_bytes(bool detector, bool classifier) const;
+
+private:
+  Params params;
+  uint64_t config = 0;
+  int fd = -1;
+  size_t mapped_bytes = 0;
+  Header* header = nullptr;
+  Slot* slots = nullptr;
+  unsigned char* data = nullptr;
+  Stats counts;
+  std::mutex lock;
+};
@@ -11,9 +11,10 @@ private:
   std::stack<std::chrono::high_resolution_clock::time_point> tictoc_stack;
 
 public:
+  // one instance per thread, tic() and toc() pair up within the thread that calls them
   static Timer& GetInstance()
   {
-    static Timer timer;
+    static thread_local Timer timer;
     return timer;
   }
 